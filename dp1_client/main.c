@@ -15,9 +15,24 @@
 #include    <arpa/inet.h>
 #include    <netdb.h>
 #include    <limits.h>
+#include    <pthread.h>
+#include    <fcntl.h>
+#include    <endian.h>
+#include    <sys/mman.h>
+#include    <time.h>
 #include    "protocol.h"
 
 #define CLIENTBUFLEN	4096
+#define MAX_WINDOW 64       /* requests in flight, small enough for all of them to fit in the socket buffers */
+#define MAX_CONNECTIONS 64
+
+/* responses to MGET, see receive_frames() */
+#define FRAME_CHUNK (64 * 1024)
+#define FRAME_HEADER_LEN 9
+#define FRAME_HEAD  'H'
+#define FRAME_DATA  'D'
+#define FRAME_ERROR 'E'
+#define MAX_LEN_MULTIPLEXED_REQUEST 300 /* "MGET <id> <file name>\r\n", names longer than the server accepts are cut */
 char *program_name;
 
 
@@ -26,7 +41,7 @@ char *program_name;
  * 0 the requested file does not exist on the server
  * 1 successful file transmission
  * -1 error occurred during file transmission
- * -2 select() timeout expired
+ * -2 timeout expired
  *
  * the calling function is responsible of closing the file descriptor.
 */
@@ -122,68 +137,243 @@ int receive_file(int connected_socket, char* buf, FILE* write_file, uint32_t* ti
 }
 
 
-int send_request (int connected_socket, char* buffer, const char* file_name) {
-    int cursor = 0;
+/* receives num_bytes bytes of content and writes them at offset in file_fd, returns 1 or the error of recv_n() */
+int receive_body(int connected_socket, char* buf, int file_fd, off_t offset, uint64_t num_bytes) {
+    while (num_bytes > 0) {
+        size_t block = num_bytes < CLIENTBUFLEN ? (size_t) num_bytes : CLIENTBUFLEN;
+        int outcome = recv_n(connected_socket, buf, block);
+        if (outcome < 0) {
+            return outcome;
+        }
+        if (pwrite(file_fd, buf, block, offset) != (ssize_t) block) {
+            /* error occurred while writing on the file */
+            return -1;
+        }
+        offset += block;
+        num_bytes -= block;
+    }
+    return 1;
+}
+
 
-    buffer[cursor++] = 'G';
-    buffer[cursor++] = 'E';
-    buffer[cursor++] = 'T';
-    buffer[cursor++] = ' ';
-    for (int i = 0; file_name[i] != '\0'; ++i) {
-        buffer[cursor++] = file_name[i];
+/*
+ * receives a file in the v2 format: "+OK\r\n", then length, file size and modification time in nanoseconds, 64 bits
+ * each, then the content. The size comes first, so the file is allocated at once and the content is received
+ * directly in a shared mapping of it. file_fd must be open for reading and writing.
+ * the function returns the same values of receive_file().
+ */
+int receive_file_v2(int connected_socket, char* buf, int file_fd, uint64_t* file_size, uint64_t* mtime_ns) {
+    int outcome = recv_n(connected_socket, buf, 1);
+    if (outcome < 0) {
+        /* error while receiving data from the server, -1 generic error, -2 timeout expired */
+        return outcome;
+    }
 
-        if (cursor >= (CLIENTBUFLEN - 2)) {
+    if (buf[0] == '-') {
+        /*  requested file doesn't exist in target server */
+        outcome = recv_n(connected_socket, buf, 5);
+        if (outcome < 0) {
+            return outcome;
+        }
+        if (buf[0] != 'E' || buf[1] != 'R' || buf[2] != 'R' || buf[3] != '\r' || buf[4] != '\n') {
+            /* invalid error message */
             return -1;
         }
+        return 0;
     }
-    buffer[cursor++] = '\r';
-    buffer[cursor++] = '\n';
-    int outcome = send_n(connected_socket, buffer, (size_t)cursor);
-    if (outcome == -1) {
+    if (buf[0] != '+') {
+        /* illicit response  */
         return -1;
     }
 
+    outcome = recv_n(connected_socket, buf, 28);
+    if (outcome < 0) {
+        return outcome;
+    }
+    if (buf[0] != 'O' || buf[1] != 'K' || buf[2] != '\r' || buf[3] != '\n') {
+        /* invalid file transfer */
+        return -1;
+    }
+    uint64_t heading[3];
+    memcpy(heading, &buf[4], 24);
+    uint64_t num_bytes = be64toh(heading[0]);
+    *file_size = be64toh(heading[1]);
+    *mtime_ns = be64toh(heading[2]);
+    if (num_bytes != *file_size || num_bytes > (uint64_t) SSIZE_MAX) {
+        /* a GET response carries the whole file */
+        return -1;
+    }
+    if (num_bytes == 0) {
+        return 1;
+    }
+
+    if ((errno = posix_fallocate(file_fd, 0, (off_t) num_bytes)) != 0 && (errno != EOPNOTSUPP && errno != EINVAL)) {
+        /* no room for the file on the local file system */
+        return -1;
+    }
+    if (ftruncate(file_fd, (off_t) num_bytes) != 0) {
+        /* where the allocation is not supported the file is still empty, and the mapping of it would fault */
+        return -1;
+    }
+    char* content = mmap(NULL, num_bytes, PROT_WRITE, MAP_SHARED, file_fd, 0);
+    if (content == MAP_FAILED) {
+        /* file system without shared mappings, write the content with pwrite() */
+        return receive_body(connected_socket, buf, file_fd, 0, num_bytes);
+    }
+
+    /* a whole file in one call: its deadline restarts with every recv(), unlike the one of recv_n() */
+    outcome = recv_stream(connected_socket, content, num_bytes);
+    munmap(content, num_bytes);
+    if (outcome < 0) {
+        if (ftruncate(file_fd, 0) != 0) {
+            /* the caller removes the file anyway */
+        }
+        return outcome;
+    }
     return 1;
 }
 
 
-int client_service (int connected_socket, char** file_names, int num_requested_files) {
+/* writes "GET <file_name>\r\n" in buffer, returns its length or -1 if it does not fit in room bytes */
+int build_request (char* buffer, size_t room, const char* file_name) {
+    size_t name_len = strlen(file_name);
+
+    if (name_len + 6 > room) {
+        return -1;
+    }
+    memcpy(buffer, "GET ", 4);
+    memcpy(&buffer[4], file_name, name_len);
+    buffer[name_len + 4] = '\r';
+    buffer[name_len + 5] = '\n';
+
+    return (int) name_len + 6;
+}
+
+
+/* sends the requests for n_files files in as few send() calls as possible */
+int send_requests (int connected_socket, char* buffer, char** file_names, int n_files) {
+    size_t cursor = 0;
+
+    for (int i = 0; i < n_files; ++i) {
+        int len = build_request(&buffer[cursor], CLIENTBUFLEN - cursor, file_names[i]);
+        if (len < 0 && cursor > 0) {
+            /* buffer is full, send the requests built so far */
+            if (send_n(connected_socket, buffer, cursor) == -1) {
+                return -1;
+            }
+            cursor = 0;
+            len = build_request(buffer, CLIENTBUFLEN, file_names[i]);
+        }
+        if (len < 0) {
+            /* file name too long */
+            return -1;
+        }
+        cursor += len;
+    }
+    if (cursor > 0 && send_n(connected_socket, buffer, cursor) == -1) {
+        return -1;
+    }
+
+    return 1;
+}
+
+
+/* files to download, shared by all the connections to the server */
+struct file_queue {
+    char** file_names;
+    int num_files;
+    int next;                           /* next file to request, claimed atomically by the connections */
+    uint64_t received_bytes;            /* updated atomically */
+    int failed_files;
+};
+
+
+/* returns the index of the next file to request, -1 if all of them have been claimed */
+int claim_file(struct file_queue* queue) {
+    int a = __atomic_fetch_add(&queue->next, 1, __ATOMIC_RELAXED);
+    return a < queue->num_files ? a : -1;
+}
+
+
+/*
+ * up to window requests are kept in flight: the window is refilled with the next files of the queue when half
+ * of it has been answered, and the responses are received in the order of the requests.
+ * window = 1 is the classic one request per RTT.
+ */
+int client_service (int connected_socket, struct file_queue* queue, int window, int version) {
     char buf[CLIENTBUFLEN + 1];
     buf[CLIENTBUFLEN] = '\0';
     int outcome = 0;
+    char** file_names = queue->file_names;
+    int requested[MAX_WINDOW];          /* files requested and not received yet, in order */
+    int first = 0, in_flight = 0;
+    int queue_empty = 0;
+
+    while (1) {
+        if (in_flight <= window / 2 && !queue_empty) {
+            /* send request(s) to Server */
+            char* names[MAX_WINDOW];
+            int to_send = 0;
+            while (in_flight + to_send < window) {
+                int a = claim_file(queue);
+                if (a < 0) {
+                    queue_empty = 1;
+                    break;
+                }
+                printf("sending request for file number %d: %s\n", a + 1, file_names[a]);
+                requested[(first + in_flight + to_send) % MAX_WINDOW] = a;
+                names[to_send++] = file_names[a];
+            }
+            if (to_send > 0) {
+                outcome = send_requests(connected_socket, buf, names, to_send);
+                if (outcome < 0) {
+                    /* error while sending request to Server */
+                    printf("error while sending request to server.\n");
+                    __atomic_fetch_add(&queue->failed_files, in_flight + to_send, __ATOMIC_RELAXED);
+                    return -1;
+                }
+                in_flight += to_send;
+            }
+        }
+        if (in_flight == 0) {
+            /* all files received */
+            break;
+        }
+        int a = requested[first];
+        first = (first + 1) % MAX_WINDOW;
+        in_flight--;
 
-    for (int a = 0; a < num_requested_files; a++) {
         /* create file descriptor for file to transfer on local file system */
-        FILE* transfer_file = fopen(file_names[a], "w");
+        FILE* transfer_file = fopen(file_names[a], version == 2 ? "w+" : "w");
         if (transfer_file == NULL) {
             printf("error occurred while opening/creating new file on local file system - closing connection with the server.\n");
-            return -1;
-        }
-
-        /* send request to Server */
-        printf("sending request for file number %d: %s\n", a + 1, file_names[a]);
-        outcome = send_request(connected_socket, buf, file_names[a]);
-        if (outcome < 0) {
-            /* error while sending request to Server */
-            printf("error while sending request to server.\n");
-            fclose(transfer_file);
+            __atomic_fetch_add(&queue->failed_files, in_flight + 1, __ATOMIC_RELAXED);
             return -1;
         }
 
         /* receive server response */
-        uint32_t timestamp = 0;
-        uint32_t file_size = 0;
-        outcome = receive_file(connected_socket, buf, transfer_file, &timestamp, &file_size);
+        uint64_t file_size = 0;
+        uint64_t mtime_ns = 0;
+        if (version == 2) {
+            outcome = receive_file_v2(connected_socket, buf, fileno(transfer_file), &file_size, &mtime_ns);
+        }
+        else {
+            uint32_t timestamp = 0;
+            uint32_t legacy_size = 0;
+            outcome = receive_file(connected_socket, buf, transfer_file, &timestamp, &legacy_size);
+            file_size = legacy_size;
+            mtime_ns = (uint64_t) timestamp * 1000000000;
+        }
         if (outcome == 1) {
             /* successful transfer from server, continue loop */
-            printf("Successful file transfer:\n\tname of file: %s\n\tsize of file: %lu\n\ttimestamp of last modification: %lu\n", file_names[a], (unsigned long)file_size, (unsigned long)timestamp);
+            printf("Successful file transfer:\n\tname of file: %s\n\tsize of file: %" PRIu64 "\n\ttimestamp of last modification: %" PRIu64 ".%09" PRIu64 "\n", file_names[a], file_size, mtime_ns / 1000000000, mtime_ns % 1000000000);
+            __atomic_fetch_add(&queue->received_bytes, file_size, __ATOMIC_RELAXED);
         }
         else if (outcome == 0) {
             /* requested file does not exist on the server, continue loop */
             printf("requested file doesn't exist in the server.\n");
             fclose(transfer_file);
             remove(file_names[a]);
-            return -1;
         }
         else if (outcome == -1) {
             /* error while receiving server's response */
@@ -191,14 +381,18 @@ int client_service (int connected_socket, char** file_names, int num_requested_f
             fclose(transfer_file);
             /* removing wrong (not complete) file from local file system */
             remove(file_names[a]);
-            return -1;
         }
         else if (outcome == -2) {
-            /* timeout of select() expired */
-            printf("error occurred - timeout of select() expired during file transfer (15 seconds).\n");
+            /* timeout expired */
+            printf("error occurred - timeout expired during file transfer (%d seconds).\n", SOCKET_TIMEOUT);
             fclose(transfer_file);
             /* removing wrong (not complete) file from local file system */
             remove(file_names[a]);
+        }
+
+        if (outcome != 1) {
+            /* the file and the ones requested after it are lost */
+            __atomic_fetch_add(&queue->failed_files, in_flight + 1, __ATOMIC_RELAXED);
             return -1;
         }
 
@@ -210,6 +404,735 @@ int client_service (int connected_socket, char** file_names, int num_requested_f
 }
 
 
+/* a file being received in frames */
+struct incoming {
+    int index;                          /* in the queue, also the ID of the request; -1 for a free slot */
+    int file_fd;                        /* -1 until the FRAME_HEAD frame */
+    uint64_t file_size;
+    uint64_t received;
+    uint64_t mtime_ns;
+};
+
+
+/* closes and removes the files not completely received */
+void drop_incoming(struct incoming* files, struct file_queue* queue) {
+    for (int a = 0; a < MAX_WINDOW; a++) {
+        if (files[a].index >= 0) {
+            if (files[a].file_fd >= 0) {
+                close(files[a].file_fd);
+                remove(queue->file_names[files[a].index]);
+            }
+            files[a].index = -1;
+            __atomic_fetch_add(&queue->failed_files, 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+
+/*
+ * requests up to window files with "MGET <id> <file name>\r\n" and receives the frames of the responses in the order
+ * the server interleaves them: a slow file does not hold back the others. Every frame is the request ID, the frame
+ * type and the payload length (4, 1 and 4 bytes), then the payload: size and modification time in nanoseconds for
+ * FRAME_HEAD, a piece of content for FRAME_DATA, nothing for FRAME_ERROR.
+ */
+int receive_frames(int connected_socket, struct file_queue* queue, int window) {
+    char frame[FRAME_HEADER_LEN + FRAME_CHUNK];
+    struct incoming files[MAX_WINDOW];
+    int in_flight = 0;
+    int queue_empty = 0;
+    int outcome = 0;
+
+    for (int a = 0; a < MAX_WINDOW; a++) {
+        files[a].index = -1;
+    }
+
+    while (1) {
+        if (in_flight <= window / 2 && !queue_empty) {
+            /* send request(s) to Server */
+            size_t cursor = 0;
+            for (int slot = 0; slot < MAX_WINDOW && in_flight < window; slot++) {
+                if (files[slot].index >= 0) {
+                    continue;
+                }
+                int a = claim_file(queue);
+                if (a < 0) {
+                    queue_empty = 1;
+                    break;
+                }
+                printf("sending request for file number %d: %s\n", a + 1, queue->file_names[a]);
+                if (cursor + MAX_LEN_MULTIPLEXED_REQUEST > CLIENTBUFLEN) {
+                    if (send_n(connected_socket, frame, cursor) == -1) {
+                        outcome = -1;
+                        break;
+                    }
+                    cursor = 0;
+                }
+                int len = snprintf(&frame[cursor], CLIENTBUFLEN - cursor, "MGET %d %s\r\n", a, queue->file_names[a]);
+                files[slot].index = a;
+                files[slot].file_fd = -1;
+                in_flight++;
+                if (len < 0 || (size_t) len >= CLIENTBUFLEN - cursor) {
+                    /* file name too long */
+                    outcome = -1;
+                    break;
+                }
+                cursor += (size_t) len;
+            }
+            if (outcome < 0 || (cursor > 0 && send_n(connected_socket, frame, cursor) == -1)) {
+                printf("error while sending request to server.\n");
+                drop_incoming(files, queue);
+                return -1;
+            }
+        }
+        if (in_flight == 0) {
+            /* all files received */
+            break;
+        }
+
+        /* receive the next frame, for any of the requests */
+        outcome = recv_n(connected_socket, frame, FRAME_HEADER_LEN);
+        uint32_t id, payload_len;
+        memcpy(&id, &frame[0], 4);
+        memcpy(&payload_len, &frame[5], 4);
+        id = ntohl(id);
+        payload_len = ntohl(payload_len);
+        char type = frame[4];
+        int slot = 0;
+        while (slot < MAX_WINDOW && files[slot].index != (int) id) {
+            slot++;
+        }
+        if (outcome >= 0 && (slot == MAX_WINDOW || payload_len > FRAME_CHUNK)) {
+            /* frame for a file never requested */
+            outcome = -1;
+        }
+        if (outcome >= 0 && payload_len > 0) {
+            outcome = recv_n(connected_socket, &frame[FRAME_HEADER_LEN], payload_len);
+        }
+        if (outcome < 0) {
+            printf(outcome == -2 ? "error occurred - timeout expired during file transfer (%d seconds).\n" : "error during file transmission from server.\n", SOCKET_TIMEOUT);
+            drop_incoming(files, queue);
+            return -1;
+        }
+
+        struct incoming* file = &files[slot];
+        const char* file_name = queue->file_names[file->index];
+        if (type == FRAME_ERROR) {
+            if (file->file_fd >= 0) {
+                /* the server could not send the rest of the file: removing the partial file from local file system */
+                printf("error during the transmission of file %s from server.\n", file_name);
+                close(file->file_fd);
+                remove(file_name);
+            }
+            else {
+                printf("requested file %s doesn't exist in the server.\n", file_name);
+            }
+            __atomic_fetch_add(&queue->failed_files, 1, __ATOMIC_RELAXED);
+            file->index = -1;
+            in_flight--;
+            continue;
+        }
+        if (type == FRAME_HEAD && payload_len == 16 && file->file_fd < 0) {
+            uint64_t heading[2];
+            memcpy(heading, &frame[FRAME_HEADER_LEN], 16);
+            file->file_size = be64toh(heading[0]);
+            file->mtime_ns = be64toh(heading[1]);
+            file->received = 0;
+            file->file_fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (file->file_fd < 0) {
+                printf("error occurred while opening/creating new file on local file system - closing connection with the server.\n");
+                drop_incoming(files, queue);
+                return -1;
+            }
+            if (file->file_size > 0) {
+                posix_fallocate(file->file_fd, 0, (off_t) file->file_size);
+            }
+        }
+        else if (type == FRAME_DATA && file->file_fd >= 0 && payload_len <= file->file_size - file->received) {
+            if (pwrite(file->file_fd, &frame[FRAME_HEADER_LEN], payload_len, (off_t) file->received) != (ssize_t) payload_len) {
+                printf("error occurred while writing file %s on local file system.\n", file_name);
+                drop_incoming(files, queue);
+                return -1;
+            }
+            file->received += payload_len;
+        }
+        else {
+            /* illicit frame */
+            printf("error during file transmission from server.\n");
+            drop_incoming(files, queue);
+            return -1;
+        }
+
+        if (file->received == file->file_size) {
+            close(file->file_fd);
+            printf("Successful file transfer:\n\tname of file: %s\n\tsize of file: %" PRIu64 "\n\ttimestamp of last modification: %" PRIu64 ".%09" PRIu64 "\n", file_name, file->file_size, file->mtime_ns / 1000000000, file->mtime_ns % 1000000000);
+            __atomic_fetch_add(&queue->received_bytes, file->file_size, __ATOMIC_RELAXED);
+            file->index = -1;
+            in_flight--;
+        }
+    }
+
+    return 1;
+}
+
+
+/* asks for the v2 responses on a new connection, returns 1 if the server accepted them */
+int ask_version_2(int connected_socket) {
+    char reply[5];
+    return send_n(connected_socket, "HELO 2\r\n", 8) != -1 && recv_n(connected_socket, reply, 5) >= 0 && memcmp(reply, "+OK\r\n", 5) == 0;
+}
+
+
+/*
+ * connects to the server and, unless legacy is set, asks for the v2 responses. A server that only knows the legacy
+ * format closes the connection on "HELO 2": the function then connects again and uses the legacy format.
+ */
+int open_connection(struct sockaddr_in* saddr, int legacy, int* version) {
+    int connected_socket = Socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    Connect(connected_socket, (struct sockaddr *) saddr, sizeof(*saddr));
+    *version = 1;
+    if (legacy) {
+        return connected_socket;
+    }
+
+    if (ask_version_2(connected_socket)) {
+        *version = 2;
+        return connected_socket;
+    }
+    Close(connected_socket);
+    connected_socket = Socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    Connect(connected_socket, (struct sockaddr *) saddr, sizeof(*saddr));
+    return connected_socket;
+}
+
+
+/* as open_connection(), but returns -1 on error: the server may be unreachable for a while */
+int reconnect(struct sockaddr_in* saddr, int legacy, int* version) {
+    *version = 1;
+    for (int attempt = legacy ? 1 : 0; attempt < 2; attempt++) {
+        int connected_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (connected_socket < 0) {
+            return -1;
+        }
+        if (connect(connected_socket, (struct sockaddr *) saddr, sizeof(*saddr)) != 0) {
+            printf("(%s) error - connect() failed - %s\n", program_name, strerror(errno));
+            close(connected_socket);
+            return -1;
+        }
+        if (attempt == 1) {
+            return connected_socket;
+        }
+        if (ask_version_2(connected_socket)) {
+            *version = 2;
+            return connected_socket;
+        }
+        /* legacy server, it closed the connection */
+        close(connected_socket);
+    }
+    return -1;
+}
+
+
+/*
+ * receives the heading of a response to GETR or RESM after its '+': the number of bytes that follow, the size of the
+ * file and its timestamp, as the server sends it: the modification time in nanoseconds in the v2 format, the 32 bit
+ * timestamp of the legacy format otherwise. The legacy timestamp of a GETR response only comes after the content, it
+ * is received by receive_trailer(). returns 1 or the error of recv_n(), -1 for an invalid heading.
+ */
+int receive_heading(int connected_socket, char* buf, int version, int with_timestamp, uint64_t* num_bytes, uint64_t* file_size, uint64_t* timestamp) {
+    if (version == 2) {
+        int outcome = recv_n(connected_socket, buf, 28);
+        if (outcome < 0) {
+            return outcome;
+        }
+        if (buf[0] != 'O' || buf[1] != 'K' || buf[2] != '\r' || buf[3] != '\n') {
+            /* invalid file transfer */
+            return -1;
+        }
+        uint64_t heading[3];
+        memcpy(heading, &buf[4], 24);
+        *num_bytes = be64toh(heading[0]);
+        *file_size = be64toh(heading[1]);
+        *timestamp = be64toh(heading[2]);
+        return 1;
+    }
+
+    size_t heading_len = with_timestamp ? 16 : 12;
+    int outcome = recv_n(connected_socket, buf, heading_len);
+    if (outcome < 0) {
+        return outcome;
+    }
+    if (buf[0] != 'O' || buf[1] != 'K' || buf[2] != '\r' || buf[3] != '\n') {
+        /* invalid file transfer */
+        return -1;
+    }
+    uint32_t heading[3];
+    memcpy(heading, &buf[4], heading_len - 4);
+    *num_bytes = ntohl(heading[0]);
+    *file_size = ntohl(heading[1]);
+    *timestamp = with_timestamp ? ntohl(heading[2]) : 0;
+    return 1;
+}
+
+
+/* receives the legacy timestamp after the content, the v2 format has none. returns 1 or the error of recv_n() */
+int receive_trailer(int connected_socket, char* buf, int version, uint64_t* timestamp) {
+    if (version == 2) {
+        return 1;
+    }
+    uint32_t file_time = 0;
+    int outcome = recv_n(connected_socket, buf, 4);
+    if (outcome < 0) {
+        return outcome;
+    }
+    memcpy(&file_time, &buf[0], 4);
+    *timestamp = ntohl(file_time);
+    return 1;
+}
+
+
+/*
+ * receives the response to "GETR <offset> <length> <file name>" and writes the bytes at their offset in file_fd.
+ * the function returns the same values of receive_file(); *length is the number of bytes actually received, the
+ * timestamp is the one of receive_heading().
+ */
+int receive_range(int connected_socket, char* buf, int version, int file_fd, uint64_t offset, uint64_t* length, uint64_t* file_size, uint64_t* timestamp) {
+    int outcome = recv_n(connected_socket, buf, 1);
+    if (outcome < 0) {
+        /* error while receiving data from the server, -1 generic error, -2 timeout expired */
+        return outcome;
+    }
+
+    if (buf[0] == '-') {
+        /*  requested file doesn't exist in target server, or the range starts after its end */
+        outcome = recv_n(connected_socket, buf, 5);
+        if (outcome < 0) {
+            return outcome;
+        }
+        if (buf[0] != 'E' || buf[1] != 'R' || buf[2] != 'R' || buf[3] != '\r' || buf[4] != '\n') {
+            /* invalid error message */
+            return -1;
+        }
+        return 0;
+    }
+    if (buf[0] != '+') {
+        /* illicit response  */
+        return -1;
+    }
+
+    outcome = receive_heading(connected_socket, buf, version, 0, length, file_size, timestamp);
+    if (outcome < 0) {
+        return outcome;
+    }
+
+    /* receive the range and write it in place */
+    outcome = receive_body(connected_socket, buf, file_fd, (off_t) offset, *length);
+    if (outcome < 0) {
+        return outcome;
+    }
+    return receive_trailer(connected_socket, buf, version, timestamp);
+}
+
+
+/* one file downloaded in chunks over several connections */
+struct chunk_job {
+    const char* file_name;
+    int file_fd;
+    uint64_t file_size;
+    uint64_t timestamp;             /* of the first chunk, every other chunk must come from the same version */
+    uint64_t chunk_size;
+    uint64_t num_chunks;
+    uint64_t next;                  /* next chunk to request, claimed atomically by the connections */
+    int failed;
+};
+
+
+/* requests the chunks of job on the connection until there are no more, returns -1 on error */
+int fetch_chunks(int connected_socket, int version, struct chunk_job* job) {
+    char buf[CLIENTBUFLEN];
+
+    while (!__atomic_load_n(&job->failed, __ATOMIC_RELAXED)) {
+        uint64_t chunk = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if (chunk >= job->num_chunks) {
+            return 1;
+        }
+        /* chunk < num_chunks: the offset is within the file */
+        uint64_t offset = chunk * job->chunk_size;
+        uint64_t length = job->file_size - offset < job->chunk_size ? job->file_size - offset : job->chunk_size;
+        int request_len = snprintf(buf, sizeof(buf), "GETR %" PRIu64 " %" PRIu64 " %s\r\n", offset, length, job->file_name);
+        if (request_len < 0 || (size_t) request_len >= sizeof(buf) || send_n(connected_socket, buf, (size_t) request_len) == -1) {
+            printf("error while sending request to server.\n");
+            return -1;
+        }
+
+        uint64_t received = 0, file_size = 0, timestamp = 0;
+        int outcome = receive_range(connected_socket, buf, version, job->file_fd, offset, &received, &file_size, &timestamp);
+        if (outcome != 1) {
+            printf("error during the transfer of the chunk at offset %" PRIu64 " of file %s.\n", offset, job->file_name);
+            return -1;
+        }
+        if (received != length || file_size != job->file_size || timestamp != job->timestamp) {
+            printf("file %s changed on the server during the transfer.\n", job->file_name);
+            return -1;
+        }
+    }
+    return -1;
+}
+
+
+/* one of the connections downloading the chunks of a file */
+struct chunk_connection {
+    pthread_t thread;
+    struct sockaddr_in* saddr;
+    struct chunk_job* job;
+    int legacy;
+};
+
+
+void* chunk_thread(void* arg) {
+    struct chunk_connection* connection = arg;
+
+    int version;
+    int connected_socket = open_connection(connection->saddr, connection->legacy, &version);
+    if (fetch_chunks(connected_socket, version, connection->job) < 0) {
+        __atomic_store_n(&connection->job->failed, 1, __ATOMIC_RELAXED);
+    }
+    Close(connected_socket);
+    return NULL;
+}
+
+
+/*
+ * downloads file_name in chunks of chunk_size bytes over connections parallel connections. The first chunk tells
+ * the size of the file, which is then allocated on disk and filled in place by all the connections.
+ * returns the size of the file, -1 on error.
+ */
+int64_t download_in_chunks(struct sockaddr_in* saddr, const char* file_name, int connections, uint64_t chunk_size, int legacy) {
+    struct chunk_job job;
+    char buf[CLIENTBUFLEN];
+
+    job.file_name = file_name;
+    job.chunk_size = chunk_size;
+    job.failed = 0;
+    job.file_fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (job.file_fd < 0) {
+        printf("error occurred while opening/creating new file on local file system.\n");
+        return -1;
+    }
+
+    int version;
+    int connected_socket = open_connection(saddr, legacy, &version);
+
+    /* first chunk */
+    printf("sending request for file %s in chunks of %" PRIu64 " bytes over %d connections\n", file_name, chunk_size, connections);
+    int request_len = snprintf(buf, sizeof(buf), "GETR 0 %" PRIu64 " %s\r\n", chunk_size, file_name);
+    int outcome = -1;
+    uint64_t received = 0;
+    if (request_len > 0 && (size_t) request_len < sizeof(buf) && send_n(connected_socket, buf, (size_t) request_len) != -1) {
+        outcome = receive_range(connected_socket, buf, version, job.file_fd, 0, &received, &job.file_size, &job.timestamp);
+    }
+    if (outcome == 1 && job.file_size > (uint64_t) INT64_MAX) {
+        /* no such file on the local file system */
+        outcome = -1;
+    }
+    if (outcome != 1) {
+        printf(outcome == 0 ? "requested file doesn't exist in the server.\n" : "error during file transmission from server.\n");
+        Close(connected_socket);
+        close(job.file_fd);
+        remove(file_name);
+        return -1;
+    }
+
+    /* allocate the rest of the file, the chunks are written in place */
+    job.num_chunks = job.file_size / chunk_size + (job.file_size % chunk_size != 0);
+    job.next = 1;
+    if (job.file_size > received && (errno = posix_fallocate(job.file_fd, 0, (off_t) job.file_size)) != 0 && errno != EOPNOTSUPP && errno != EINVAL) {
+        printf("error while allocating %" PRIu64 " bytes for file %s - %s\n", job.file_size, file_name, strerror(errno));
+        job.failed = 1;
+    }
+
+    struct chunk_connection others[MAX_CONNECTIONS];
+    int started = 0;
+    for (int a = 1; a < connections && job.num_chunks > 1 && !job.failed; a++) {
+        others[started].saddr = saddr;
+        others[started].job = &job;
+        others[started].legacy = legacy;
+        if (pthread_create(&others[started].thread, NULL, chunk_thread, &others[started]) != 0) {
+            /* the chunks are shared among the connections already open */
+            break;
+        }
+        started++;
+    }
+    if (!job.failed && fetch_chunks(connected_socket, version, &job) < 0) {
+        __atomic_store_n(&job.failed, 1, __ATOMIC_RELAXED);
+    }
+    /* close before waiting for the others: a server process serving connections one at a time may hold them back */
+    Close(connected_socket);
+    for (int a = 0; a < started; a++) {
+        pthread_join(others[a].thread, NULL);
+    }
+    close(job.file_fd);
+
+    if (job.failed) {
+        /* removing wrong (not complete) file from local file system */
+        remove(file_name);
+        return -1;
+    }
+    printf("Successful file transfer:\n\tname of file: %s\n\tsize of file: %" PRIu64 "\n\ttimestamp of last modification: %" PRIu64 "\n", file_name, job.file_size, job.timestamp);
+    return (int64_t) job.file_size;
+}
+
+
+#define MAX_RESUME_ATTEMPTS 5
+#define RESUME_SUFFIX ".resume"
+
+/*
+ * receives the response to "RESM <offset> <timestamp> <file name>" and writes the rest of the file from offset.
+ * size and timestamp of the file arrive before the content and are recorded in the sidecar file with the format of
+ * the response, so that the transfer can be resumed again if it gets interrupted.
+ * the function returns the same values of receive_file(), and -3 if the file changed since the interrupted transfer.
+ */
+int receive_resumed(int connected_socket, char* buf, int version, int file_fd, const char* sidecar_name, uint64_t offset, uint64_t* file_size, uint64_t* timestamp) {
+    int outcome = recv_n(connected_socket, buf, 1);
+    if (outcome < 0) {
+        /* error while receiving data from the server, -1 generic error, -2 timeout expired */
+        return outcome;
+    }
+
+    if (buf[0] == '-') {
+        outcome = recv_n(connected_socket, buf, 5);
+        if (outcome < 0) {
+            return outcome;
+        }
+        if (memcmp(buf, "ERR\r\n", 5) == 0) {
+            return 0;
+        }
+        if (memcmp(buf, "CHG\r\n", 5) == 0) {
+            return -3;
+        }
+        /* invalid error message */
+        return -1;
+    }
+    if (buf[0] != '+') {
+        /* illicit response  */
+        return -1;
+    }
+
+    uint64_t num_bytes;
+    outcome = receive_heading(connected_socket, buf, version, 1, &num_bytes, file_size, timestamp);
+    if (outcome < 0) {
+        return outcome;
+    }
+
+    FILE* sidecar = fopen(sidecar_name, "w");
+    if (sidecar == NULL) {
+        return -1;
+    }
+    int written = fprintf(sidecar, "%d %" PRIu64 " %" PRIu64 "\n", version, *file_size, *timestamp);
+    if (fclose(sidecar) != 0 || written < 0) {
+        return -1;
+    }
+
+    outcome = receive_body(connected_socket, buf, file_fd, (off_t) offset, num_bytes);
+    if (outcome < 0) {
+        return outcome;
+    }
+
+    /* the legacy trailer repeats the timestamp */
+    uint64_t repeated;
+    return receive_trailer(connected_socket, buf, version, &repeated) < 0 ? -1 : 1;
+}
+
+
+/*
+ * returns the offset where the interrupted transfer of file_name ended and the timestamp recorded in its sidecar
+ * file, 0 and 0 if there is nothing to resume. A timestamp recorded in the other format cannot be sent back to the
+ * server: the transfer starts again as well.
+ */
+uint64_t resume_point(const char* file_name, const char* sidecar_name, int version, uint64_t* timestamp) {
+    int recorded_version = 0;
+    uint64_t file_size = 0;
+    struct stat file_stat;
+
+    *timestamp = 0;
+    FILE* sidecar = fopen(sidecar_name, "r");
+    if (sidecar == NULL) {
+        return 0;
+    }
+    int matched = fscanf(sidecar, "%d %" SCNu64 " %" SCNu64, &recorded_version, &file_size, timestamp);
+    fclose(sidecar);
+    if (matched != 3 || recorded_version != version || stat(file_name, &file_stat) != 0 || (uint64_t) file_stat.st_size > file_size) {
+        /* unusable record, start from the beginning */
+        *timestamp = 0;
+        return 0;
+    }
+    return (uint64_t) file_stat.st_size;
+}
+
+
+/*
+ * downloads the files of the queue one request at a time with RESM. An interrupted transfer leaves the partial file
+ * and its sidecar file on disk: the client reconnects and requests only the missing part, up to MAX_RESUME_ATTEMPTS
+ * times. A run of the client that finds a sidecar file resumes that transfer as well.
+ */
+int resume_service(struct sockaddr_in* saddr, struct file_queue* queue, int legacy) {
+    char buf[CLIENTBUFLEN];
+    char sidecar_name[PATH_MAX];
+    int connected_socket = -1;
+    int version = 1;
+    int a;
+
+    while ((a = claim_file(queue)) >= 0) {
+        const char* file_name = queue->file_names[a];
+        if (snprintf(sidecar_name, sizeof(sidecar_name), "%s" RESUME_SUFFIX, file_name) >= (int) sizeof(sidecar_name)) {
+            __atomic_fetch_add(&queue->failed_files, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        int outcome = -1;
+        uint64_t file_size = 0, timestamp = 0, offset = 0;
+        for (int attempt = 0; attempt <= MAX_RESUME_ATTEMPTS; attempt++) {
+            if (connected_socket < 0) {
+                if (attempt > 0) {
+                    sleep(1);
+                }
+                if ((connected_socket = reconnect(saddr, legacy, &version)) < 0) {
+                    continue;
+                }
+            }
+
+            offset = resume_point(file_name, sidecar_name, version, &timestamp);
+            int file_fd = open(file_name, O_WRONLY | O_CREAT | (offset == 0 ? O_TRUNC : 0), 0644);
+            if (file_fd < 0) {
+                printf("error occurred while opening/creating new file on local file system.\n");
+                break;
+            }
+            if (offset > 0) {
+                printf("resuming transfer of file number %d: %s from byte %" PRIu64 "\n", a + 1, file_name, offset);
+            }
+            else {
+                printf("sending request for file number %d: %s\n", a + 1, file_name);
+            }
+
+            int request_len = snprintf(buf, sizeof(buf), "RESM %" PRIu64 " %" PRIu64 " %s\r\n", offset, timestamp, file_name);
+            outcome = -1;
+            if (request_len > 0 && (size_t) request_len < sizeof(buf) && send_n(connected_socket, buf, (size_t) request_len) != -1) {
+                outcome = receive_resumed(connected_socket, buf, version, file_fd, sidecar_name, offset, &file_size, &timestamp);
+            }
+            close(file_fd);
+
+            if (outcome == 1 || outcome == 0) {
+                break;
+            }
+            if (outcome == -3) {
+                /* the partial file belongs to an older version, start again on the same connection */
+                printf("file %s changed on the server, restarting its transfer.\n", file_name);
+                remove(sidecar_name);
+                continue;
+            }
+            /* connection lost or timeout expired: the partial file and its sidecar file are kept */
+            printf("error during file transmission from server - reconnecting to resume it.\n");
+            Close(connected_socket);
+            connected_socket = -1;
+        }
+
+        if (outcome == 1) {
+            remove(sidecar_name);
+            printf("Successful file transfer:\n\tname of file: %s\n\tsize of file: %" PRIu64 "\n\ttimestamp of last modification: %" PRIu64 "\n", file_name, file_size, timestamp);
+            __atomic_fetch_add(&queue->received_bytes, file_size - offset, __ATOMIC_RELAXED);
+            continue;
+        }
+        if (outcome == 0) {
+            /* the file does not exist on the server, the server closes the connection */
+            printf("requested file doesn't exist in the server.\n");
+            remove(file_name);
+            remove(sidecar_name);
+            Close(connected_socket);
+            connected_socket = -1;
+        }
+        __atomic_fetch_add(&queue->failed_files, 1, __ATOMIC_RELAXED);
+    }
+
+    if (connected_socket >= 0) {
+        Close(connected_socket);
+    }
+    return 1;
+}
+
+
+/* one parallel connection to the server */
+struct connection_job {
+    pthread_t thread;
+    struct sockaddr_in* saddr;
+    struct file_queue* queue;
+    int window;
+    int resume;
+    int legacy;
+    int multiplexed;
+};
+
+
+void* connection_thread(void* arg) {
+    struct connection_job* job = arg;
+
+    if (job->resume) {
+        resume_service(job->saddr, job->queue, job->legacy);
+        return NULL;
+    }
+    if (job->multiplexed) {
+        int connected_socket = Socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        Connect(connected_socket, (struct sockaddr *) job->saddr, sizeof(*job->saddr));
+        receive_frames(connected_socket, job->queue, job->window);
+        Close(connected_socket);
+        return NULL;
+    }
+    int version;
+    int connected_socket = open_connection(job->saddr, job->legacy, &version);
+    client_service(connected_socket, job->queue, job->window, version);
+    Close(connected_socket);
+    return NULL;
+}
+
+
+/*
+ * the size of a file is only known once its response arrives, so the connections simply take the next file of the
+ * queue when they are free. When a local copy of a file already exists (a set being downloaded again) its size is
+ * a good estimate: the queue is then ordered largest first, so that the big files do not end up last on a single
+ * connection while the others are idle.
+ */
+off_t estimated_size(const char* file_name) {
+    struct stat file_stat;
+    if (stat(file_name, &file_stat) != 0) {
+        return 0;
+    }
+    return file_stat.st_size;
+}
+
+
+void order_by_size(char** file_names, int num_files) {
+    off_t* sizes = malloc(num_files * sizeof(*sizes));
+    if (sizes == NULL) {
+        return;
+    }
+    for (int a = 0; a < num_files; a++) {
+        sizes[a] = estimated_size(file_names[a]);
+    }
+    /* stable insertion sort: the command line order is kept among files of unknown size */
+    for (int a = 1; a < num_files; a++) {
+        off_t size = sizes[a];
+        char* name = file_names[a];
+        int b = a - 1;
+        while (b >= 0 && sizes[b] < size) {
+            sizes[b + 1] = sizes[b];
+            file_names[b + 1] = file_names[b];
+            b--;
+        }
+        sizes[b + 1] = size;
+        file_names[b + 1] = name;
+    }
+    free(sizes);
+}
+
+
 int main(int argc, char *argv[])
 {
     uint16_t tport_n, tport_h;	/* server port number (net/host ord) */
@@ -220,17 +1143,64 @@ int main(int argc, char *argv[])
 
     program_name = argv[0];
 
-    if (argc < 4) {
-        printf("Usage: %s <IP server address> <port number> <file name 1> <file name 2> ... <file name n>\n", program_name);
+    int window = 1;
+    int connections = 1;
+    uint64_t chunk_size = 0;            /* -s: download every file in chunks of this size over the connections */
+    int resume = 0;                     /* -r: resumable downloads */
+    int legacy = 0;                     /* -l: do not ask for the v2 responses */
+    int multiplexed = 0;                /* -m: responses in frames, out of order */
+    int option;
+    while ((option = getopt(argc, argv, "c:lmrs:w:")) != -1) {
+        switch (option) {
+            case 'm':
+                multiplexed = 1;
+                break;
+            case 'l':
+                legacy = 1;
+                break;
+            case 'r':
+                resume = 1;
+                break;
+            case 's':
+                chunk_size = strtoull(optarg, NULL, 0);
+                if (chunk_size > 0 && chunk_size < ULLONG_MAX) {
+                    break;
+                }
+                printf("the chunk size must be a positive number of bytes\n");
+                printf("Usage: %s [-c <connections>] [-l] [-m] [-r] [-s <chunk size>] [-w <requests in flight>] <IP server address> <port number> <file name 1> <file name 2> ... <file name n>\n", program_name);
+                exit(-1);
+            case 'c':
+                connections = atoi(optarg);
+                if (connections >= 1 && connections <= MAX_CONNECTIONS) {
+                    break;
+                }
+                printf("the number of connections must be between 1 and %d\n", MAX_CONNECTIONS);
+                printf("Usage: %s [-c <connections>] [-l] [-m] [-r] [-s <chunk size>] [-w <requests in flight>] <IP server address> <port number> <file name 1> <file name 2> ... <file name n>\n", program_name);
+                exit(-1);
+            case 'w':
+                window = atoi(optarg);
+                if (window >= 1 && window <= MAX_WINDOW) {
+                    break;
+                }
+                printf("the window must be between 1 and %d requests\n", MAX_WINDOW);
+                /* fall through */
+            default:
+                printf("Usage: %s [-c <connections>] [-l] [-m] [-r] [-s <chunk size>] [-w <requests in flight>] <IP server address> <port number> <file name 1> <file name 2> ... <file name n>\n", program_name);
+                exit(-1);
+        }
+    }
+
+    if (argc - optind < 3) {
+        printf("Usage: %s [-c <connections>] [-l] [-m] [-r] [-s <chunk size>] [-w <requests in flight>] <IP server address> <port number> <file name 1> <file name 2> ... <file name n>\n", program_name);
         exit(-1);
     }
-    outcome = inet_aton(argv[1], &sIPaddr);
+    outcome = inet_aton(argv[optind], &sIPaddr);
     if (!outcome) {
         printf("error - enter a valid IPv4 address in the command line.\n");
         exit(-1);
     }
 
-    unsigned long tmp_port = strtoul(argv[2], NULL, 0);
+    unsigned long tmp_port = strtoul(argv[optind + 1], NULL, 0);
     if ((tmp_port == ULONG_MAX) || (tmp_port < 1024) || (tmp_port > 65535)) {
         printf("Enter a valid port number - port numbers must be between 1024 and 65535\n");
         exit(1);
@@ -239,22 +1209,89 @@ int main(int argc, char *argv[])
     tport_n = htons(tport_h);
 
 
-    /* create the socket */
-    connected_socket = Socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-
     /* prepare address structure server address */
     bzero(&saddr, sizeof(saddr));
     saddr.sin_family = AF_INET;
     saddr.sin_port   = tport_n;
     saddr.sin_addr   = sIPaddr;
 
-    /* connect to server*/
-    Connect(connected_socket, (struct sockaddr *) &saddr, sizeof(saddr));
+    struct file_queue queue;
+    queue.file_names = &argv[optind + 2];
+    queue.num_files = argc - optind - 2;
+    queue.next = 0;
+    queue.received_bytes = 0;
+    queue.failed_files = 0;
 
-    /* get service from the server*/
-    client_service(connected_socket, &argv[3], argc - 3);
-    printf("End of service for the Client - closing connection with the server.\n");
-    Close(connected_socket);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (chunk_size > 0) {
+        /* one file at a time, split over all the connections */
+        for (int a = 0; a < queue.num_files; a++) {
+            int64_t received = download_in_chunks(&saddr, queue.file_names[a], connections, chunk_size, legacy);
+            if (received < 0) {
+                queue.failed_files += queue.num_files - a;
+                break;
+            }
+            queue.received_bytes += (uint64_t) received;
+        }
+        queue.next = queue.num_files;
+        printf("End of service for the Client.\n");
+    }
+    else if (multiplexed && connections == 1) {
+        connected_socket = Socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        Connect(connected_socket, (struct sockaddr *) &saddr, sizeof(saddr));
+        receive_frames(connected_socket, &queue, window);
+        printf("End of service for the Client - closing connection with the server.\n");
+        Close(connected_socket);
+    }
+    else if (resume && connections == 1) {
+        resume_service(&saddr, &queue, legacy);
+        printf("End of service for the Client - closing connection with the server.\n");
+    }
+    else if (connections == 1) {
+        /* connect to server*/
+        int version;
+        connected_socket = open_connection(&saddr, legacy, &version);
+
+        /* get service from the server*/
+        client_service(connected_socket, &queue, window, version);
+        printf("End of service for the Client - closing connection with the server.\n");
+        Close(connected_socket);
+    }
+    else {
+        order_by_size(queue.file_names, queue.num_files);
+
+        struct connection_job jobs[MAX_CONNECTIONS];
+        int started = 0;
+        for (int a = 0; a < connections; a++) {
+            jobs[a].saddr = &saddr;
+            jobs[a].queue = &queue;
+            jobs[a].window = window;
+            jobs[a].resume = resume;
+            jobs[a].legacy = legacy;
+            jobs[a].multiplexed = multiplexed;
+            if ((errno = pthread_create(&jobs[a].thread, NULL, connection_thread, &jobs[a])) != 0) {
+                printf("error while creating the thread for connection %d - %s\n", a + 1, strerror(errno));
+                break;
+            }
+            started++;
+        }
+        for (int a = 0; a < started; a++) {
+            pthread_join(jobs[a].thread, NULL);
+        }
+        printf("End of service for the Client - closed %d connections with the server.\n", started);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    int received_files = queue.num_files - queue.failed_files;
+    if (queue.next < queue.num_files) {
+        /* files never requested because every connection failed before */
+        received_files -= queue.num_files - queue.next;
+    }
+    printf("received %d of %d files, %" PRIu64 " bytes in %.3f seconds (%.1f MB/s)\n", received_files, queue.num_files,
+           queue.received_bytes, elapsed, elapsed > 0 ? (double)queue.received_bytes / elapsed / 1e6 : 0.0);
 
     return 1;
-}
\ No newline at end of file
+}
@@ -8,6 +8,10 @@
 #include <stdio.h>
 #include <signal.h>
 #include <unistd.h>
+#include <time.h>
+
+/* seconds allowed to recv_n(), send_n(), and between two receptions of recv_stream() */
+#define SOCKET_TIMEOUT 15
 
 int Select(int max_fd, fd_set *read_set, fd_set *write_set, fd_set *except_set, struct timeval *timeout);
 int Socket (int family, int type, int protocol);
@@ -16,7 +20,10 @@ void Bind (int sockfd, const struct sockaddr *myaddr,  socklen_t myaddrlen);
 void Listen (int sockfd, int backlog);
 int Accept (int listen_sockfd, struct sockaddr *cliaddr, socklen_t *addrlenp);
 void Connect (int sockfd, const struct sockaddr *srvaddr, socklen_t addrlen);
+void set_deadline(struct timespec* deadline);
+int wait_socket(int connected_socket, short events, const struct timespec* deadline);
 int recv_n (int connected_socket, char* buffer, size_t n_elements);
+int recv_stream(int connected_socket, char* buffer, size_t n_elements);
 int send_n(int connected_socket, const char* buffer, size_t n_elements);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,455 @@
+/*
+ *  Content cache shared by the processes of the concurrent server
+ *
+ *  The parent maps a memfd before forking: the index, the slots and the responses live there, so a file read by one
+ *  child is served from memory by the following ones. The segment is divided among a few slot sizes and each size
+ *  class evicts with the CLOCK algorithm under its own lock. Lookups only take the lock of their bucket, and a slot
+ *  being sent is pinned with the pid of its sender, so an eviction never overwrites a response in flight.
+ *
+ *  A worker may die anywhere, and the supervisor starts another one. The pins and the slots being loaded carry the
+ *  pid of their owner: the CLOCK sweep gives back those of the processes that no longer exist. The robust locks
+ *  tell when a process died holding one of them, and the chains it guards are checked again.
+ *
+ *  inotify events are only seen by the processes alive when the file changes, so every entry is also compared
+ *  against stat() once every FILE_CACHE_TTL seconds, whichever process does it first.
+ *
+ */
+
+#define     _GNU_SOURCE
+#include    <stdlib.h>
+#include    <string.h>
+#include    <stdio.h>
+#include    <errno.h>
+#include    <inttypes.h>
+#include    <unistd.h>
+#include    <signal.h>
+#include    <endian.h>
+#include    <sys/mman.h>
+#include    <arpa/inet.h>
+#include    "content_cache.h"
+#include    "file_cache.h"
+
+struct size_class {
+    pthread_mutex_t lock;                           /* guards hand and the allocation of the slots of the class */
+    size_t slot_size;
+    int32_t first_slot;
+    int32_t slots;
+    int32_t hand;
+};
+
+struct shared_segment {
+    pthread_mutex_t bucket_locks[CONTENT_CACHE_LOCKS];
+    int32_t buckets[CONTENT_CACHE_BUCKETS];
+    struct size_class classes[CONTENT_CACHE_CLASSES];
+    struct content_cache_stats stats;               /* updated with atomic operations */
+    int32_t n_slots;
+    struct cached_content slots[];                  /* followed by the responses */
+};
+
+static const size_t slot_sizes[CONTENT_CACHE_CLASSES] = {
+    2048, 8192, 32768, 131072, CONTENT_HEAD_LEN + CONTENT_CACHE_MAX_FILE + 4
+};
+
+static struct shared_segment* segment = NULL;
+
+
+static uint32_t hash_name(const char* name) {
+    /* FNV-1a */
+    uint32_t hash = 2166136261u;
+    for (const unsigned char* c = (const unsigned char*) name; *c != '\0'; ++c) {
+        hash = (hash ^ *c) * 16777619u;
+    }
+    return hash;
+}
+
+
+static int process_exists(pid_t pid) {
+    return kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+
+/*
+ * a process died holding the lock of these buckets, in the middle of a link or an unlink: the slots in their chains
+ * get their bucket again, those that claim one of these buckets but are not in its chain are freed
+ */
+static void repair_buckets(int lock_index) {
+    for (int32_t a = 0; a < segment->n_slots; a++) {
+        if (segment->slots[a].bucket >= 0 && segment->slots[a].bucket % CONTENT_CACHE_LOCKS == lock_index) {
+            segment->slots[a].bucket = -3;
+        }
+    }
+    for (int32_t bucket = lock_index; bucket < CONTENT_CACHE_BUCKETS; bucket += CONTENT_CACHE_LOCKS) {
+        for (int32_t index = segment->buckets[bucket]; index >= 0; index = segment->slots[index].next_in_bucket) {
+            segment->slots[index].bucket = bucket;
+        }
+    }
+    for (int32_t a = 0; a < segment->n_slots; a++) {
+        if (segment->slots[a].bucket == -3) {
+            segment->slots[a].bucket = -1;
+        }
+    }
+}
+
+
+static void lock(pthread_mutex_t* mutex) {
+    if (pthread_mutex_lock(mutex) == EOWNERDEAD) {
+        /* a process died holding it */
+        if (mutex >= &segment->bucket_locks[0] && mutex < &segment->bucket_locks[CONTENT_CACHE_LOCKS]) {
+            repair_buckets((int) (mutex - segment->bucket_locks));
+        }
+        pthread_mutex_consistent(mutex);
+    }
+}
+
+
+static void init_mutex(pthread_mutex_t* mutex) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+
+static void count(uint64_t* counter, int64_t delta) {
+    __atomic_add_fetch(counter, (uint64_t) delta, __ATOMIC_RELAXED);
+}
+
+
+/* removes the slot from its chain, with the lock of its bucket held; a pinned slot is reused after its release */
+static void unlink_slot(struct cached_content* content) {
+    int32_t index = (int32_t) (content - segment->slots);
+    int32_t* link = &segment->buckets[content->bucket];
+    while (*link != index) {
+        link = &segment->slots[*link].next_in_bucket;
+    }
+    *link = content->next_in_bucket;
+    content->bucket = -1;
+    count(&segment->stats.entries, -1);
+    count(&segment->stats.bytes, -(int64_t) content->response_len);
+}
+
+
+/* pins the slot for this process, returns 0 if all its pins are taken */
+static int pin(struct cached_content* content, pid_t pid) {
+    for (int a = 0; a < CONTENT_CACHE_PINS; a++) {
+        pid_t unused = 0;
+        if (__atomic_compare_exchange_n(&content->pinned_by[a], &unused, pid, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/* returns 1 if a live process is sending the slot, the pins of the processes that died are given back */
+static int pinned(struct cached_content* content) {
+    int pins = 0;
+    for (int a = 0; a < CONTENT_CACHE_PINS; a++) {
+        pid_t pid = __atomic_load_n(&content->pinned_by[a], __ATOMIC_ACQUIRE);
+        if (pid != 0 && !process_exists(pid)) {
+            __atomic_compare_exchange_n(&content->pinned_by[a], &pid, 0, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+            pid = __atomic_load_n(&content->pinned_by[a], __ATOMIC_ACQUIRE);
+        }
+        pins += (pid != 0);
+    }
+    return pins > 0;
+}
+
+
+static struct cached_content* find_slot(const char* file_name, uint32_t hash) {
+    for (int32_t index = segment->buckets[hash % CONTENT_CACHE_BUCKETS]; index >= 0; index = segment->slots[index].next_in_bucket) {
+        struct cached_content* content = &segment->slots[index];
+        if (content->hash == hash && strcmp(content->name, file_name) == 0) {
+            return content;
+        }
+    }
+    return NULL;
+}
+
+
+/* maps the segment, to be called by the parent before fork(); a budget of 0 or a failure disables the cache */
+void content_cache_init(size_t budget) {
+    if (budget == 0) {
+        return;
+    }
+
+    size_t n_slots = 0;
+    size_t data_len = 0;
+    for (int a = 0; a < CONTENT_CACHE_CLASSES; a++) {
+        size_t slots = budget / CONTENT_CACHE_CLASSES / slot_sizes[a];
+        n_slots += slots;
+        data_len += slots * slot_sizes[a];
+    }
+    size_t index_len = sizeof(struct shared_segment) + n_slots * sizeof(struct cached_content);
+    index_len = (index_len + 4095) & ~(size_t) 4095;
+
+    int memfd = memfd_create("dp1 content cache", MFD_CLOEXEC);
+    if (memfd < 0 || ftruncate(memfd, (off_t) (index_len + data_len)) < 0) {
+        printf("cannot create the shared content cache - files are always sent from the file system.\n");
+        if (memfd >= 0) {
+            close(memfd);
+        }
+        return;
+    }
+    void* mapping = mmap(NULL, index_len + data_len, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    close(memfd);
+    if (mapping == MAP_FAILED) {
+        printf("cannot map the shared content cache - files are always sent from the file system.\n");
+        return;
+    }
+
+    segment = mapping;
+    for (int a = 0; a < CONTENT_CACHE_LOCKS; a++) {
+        init_mutex(&segment->bucket_locks[a]);
+    }
+    for (int a = 0; a < CONTENT_CACHE_BUCKETS; a++) {
+        segment->buckets[a] = -1;
+    }
+    segment->stats.budget = data_len;
+    segment->n_slots = (int32_t) n_slots;
+
+    char* data = (char*) mapping + index_len;
+    int32_t slot = 0;
+    for (int a = 0; a < CONTENT_CACHE_CLASSES; a++) {
+        struct size_class* class = &segment->classes[a];
+        init_mutex(&class->lock);
+        class->slot_size = slot_sizes[a];
+        class->first_slot = slot;
+        class->slots = (int32_t) (budget / CONTENT_CACHE_CLASSES / slot_sizes[a]);
+        for (int32_t b = 0; b < class->slots; b++, slot++) {
+            segment->slots[slot].bucket = -1;
+            segment->slots[slot].response = data;
+            data += slot_sizes[a];
+        }
+    }
+    printf("shared content cache: %d slots, %zu bytes of responses and %zu of index\n", segment->n_slots, data_len, index_len);
+}
+
+
+void content_cache_drop(const char* file_name) {
+    if (segment == NULL) {
+        return;
+    }
+    uint32_t hash = hash_name(file_name);
+    pthread_mutex_t* bucket_lock = &segment->bucket_locks[hash % CONTENT_CACHE_BUCKETS % CONTENT_CACHE_LOCKS];
+    lock(bucket_lock);
+    struct cached_content* content = find_slot(file_name, hash);
+    if (content != NULL) {
+        count(&segment->stats.invalidations, 1);
+        unlink_slot(content);
+    }
+    pthread_mutex_unlock(bucket_lock);
+}
+
+
+void content_cache_drop_all(void) {
+    if (segment == NULL) {
+        return;
+    }
+    for (int a = 0; a < CONTENT_CACHE_BUCKETS; a++) {
+        pthread_mutex_t* bucket_lock = &segment->bucket_locks[a % CONTENT_CACHE_LOCKS];
+        lock(bucket_lock);
+        while (segment->buckets[a] >= 0) {
+            count(&segment->stats.invalidations, 1);
+            unlink_slot(&segment->slots[segment->buckets[a]]);
+        }
+        pthread_mutex_unlock(bucket_lock);
+    }
+}
+
+
+/* returns the prepared response for file_name pinned until content_cache_release(), NULL if it is not cached or has changed */
+struct cached_content* content_cache_get(const char* file_name) {
+    if (segment == NULL) {
+        return NULL;
+    }
+    file_cache_poll_events();
+
+    uint32_t hash = hash_name(file_name);
+    pthread_mutex_t* bucket_lock = &segment->bucket_locks[hash % CONTENT_CACHE_BUCKETS % CONTENT_CACHE_LOCKS];
+    lock(bucket_lock);
+    struct cached_content* content = find_slot(file_name, hash);
+    if (content != NULL && !pin(content, getpid())) {
+        /* sent by CONTENT_CACHE_PINS processes already, this one reads the file */
+        content = NULL;
+    }
+    if (content != NULL) {
+        content->referenced = 1;
+    }
+    pthread_mutex_unlock(bucket_lock);
+    if (content == NULL) {
+        count(&segment->stats.misses, 1);
+        return NULL;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec - __atomic_load_n(&content->checked, __ATOMIC_RELAXED) >= FILE_CACHE_TTL) {
+        if (file_cache_changed(file_name, &content->file_stat)) {
+            content_cache_release(content);
+            content_cache_drop(file_name);
+            count(&segment->stats.misses, 1);
+            return NULL;
+        }
+        __atomic_store_n(&content->checked, now.tv_sec, __ATOMIC_RELAXED);
+    }
+
+    count(&segment->stats.hits, 1);
+    return content;
+}
+
+
+void content_cache_release(struct cached_content* content) {
+    pid_t pid = getpid();
+    for (int a = 0; a < CONTENT_CACHE_PINS; a++) {
+        pid_t owner = pid;
+        if (__atomic_compare_exchange_n(&content->pinned_by[a], &owner, 0, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+            return;
+        }
+    }
+}
+
+
+/* takes a slot of the class for a new response with the CLOCK algorithm, NULL if all of them are in use */
+static struct cached_content* allocate_slot(struct size_class* class) {
+    pid_t pid = getpid();
+    lock(&class->lock);
+    for (int32_t a = 0; a < 2 * class->slots; a++) {
+        struct cached_content* content = &segment->slots[class->first_slot + class->hand];
+        class->hand = (class->hand + 1) % class->slots;
+        if (content->bucket == -2 && !process_exists(content->loader)) {
+            /* its loader died: it may have been linking it, the lock of its bucket repairs that chain first */
+            pthread_mutex_t* bucket_lock = &segment->bucket_locks[content->hash % CONTENT_CACHE_BUCKETS % CONTENT_CACHE_LOCKS];
+            lock(bucket_lock);
+            if (content->bucket == -2) {
+                content->bucket = -1;
+            }
+            pthread_mutex_unlock(bucket_lock);
+        }
+        if (content->bucket == -2 || pinned(content)) {
+            continue;
+        }
+        if (content->bucket == -1) {
+            content->loader = pid;
+            content->bucket = -2;
+            pthread_mutex_unlock(&class->lock);
+            return content;
+        }
+        if (content->referenced) {
+            content->referenced = 0;
+            continue;
+        }
+
+        /* pins are only taken with the bucket lock held, check them again there */
+        int32_t bucket = content->bucket;
+        pthread_mutex_t* bucket_lock = &segment->bucket_locks[bucket % CONTENT_CACHE_LOCKS];
+        lock(bucket_lock);
+        int evicted = content->bucket == bucket && !pinned(content);
+        if (evicted) {
+            unlink_slot(content);
+            content->loader = pid;
+            content->bucket = -2;
+        }
+        pthread_mutex_unlock(bucket_lock);
+        if (evicted) {
+            count(&segment->stats.evictions, 1);
+            pthread_mutex_unlock(&class->lock);
+            return content;
+        }
+    }
+    pthread_mutex_unlock(&class->lock);
+    return NULL;
+}
+
+
+/*
+ * reads the file open in file_fd into a slot, returned pinned until content_cache_release().
+ * returns NULL if the file is too large to be cached, cannot be read or every slot of its size is in use.
+ */
+struct cached_content* content_cache_load(const char* file_name, int file_fd, const struct stat* file_stat) {
+    if (segment == NULL || strlen(file_name) >= CONTENT_CACHE_NAME_LEN) {
+        return NULL;
+    }
+    uint64_t file_size = (uint64_t) file_stat->st_size;
+    size_t response_len = CONTENT_HEAD_LEN + file_size + 4;
+    struct size_class* class = NULL;
+    for (int a = 0; a < CONTENT_CACHE_CLASSES && class == NULL; a++) {
+        if (response_len <= segment->classes[a].slot_size && segment->classes[a].slots > 0) {
+            class = &segment->classes[a];
+        }
+    }
+    if (file_size > CONTENT_CACHE_MAX_FILE || class == NULL) {
+        return NULL;
+    }
+    struct cached_content* content = allocate_slot(class);
+    if (content == NULL) {
+        return NULL;
+    }
+
+    /* the slot is not reachable by the other processes until it is linked to its bucket */
+    char* body = &content->response[CONTENT_HEAD_LEN];
+    size_t loaded = 0;
+    while (loaded < file_size) {
+        ssize_t eff_read = pread(file_fd, &body[loaded], file_size - loaded, (off_t) loaded);
+        if (eff_read <= 0) {
+            content->bucket = -1;
+            return NULL;
+        }
+        loaded += (size_t) eff_read;
+    }
+
+    /* legacy response, the timestamp in the same byte order used by send_file() */
+    uint32_t file_size_net = htonl((uint32_t) file_size);
+    uint32_t timestamp_net = htonl(htonl((uint32_t) file_stat->st_mtime));
+    memcpy(content->response, "+OK\r\n", 5);
+    memcpy(&content->response[5], &file_size_net, 4);
+    memcpy(&body[file_size], &timestamp_net, 4);
+
+    uint64_t mtime_ns = (uint64_t) file_stat->st_mtim.tv_sec * 1000000000 + (uint64_t) file_stat->st_mtim.tv_nsec;
+    uint64_t heading_net[3] = { htobe64(file_size), htobe64(file_size), htobe64(mtime_ns) };
+    memcpy(content->head_v2, "+OK\r\n", 5);
+    memcpy(&content->head_v2[5], heading_net, 24);
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    strcpy(content->name, file_name);
+    content->hash = hash_name(file_name);
+    content->file_stat = *file_stat;
+    content->checked = now.tv_sec;
+    content->file_size = file_size;
+    content->response_len = response_len;
+    content->referenced = 1;
+    memset(content->pinned_by, 0, sizeof(content->pinned_by));
+    content->pinned_by[0] = content->loader;
+
+    int32_t bucket = (int32_t) (content->hash % CONTENT_CACHE_BUCKETS);
+    pthread_mutex_t* bucket_lock = &segment->bucket_locks[bucket % CONTENT_CACHE_LOCKS];
+    lock(bucket_lock);
+    struct cached_content* previous = find_slot(file_name, content->hash);
+    if (previous != NULL) {
+        /* loaded by another process meanwhile, or an older version */
+        unlink_slot(previous);
+    }
+    /* in the chain before it has a bucket: a process dying in between leaves a chain repair_buckets() can fix */
+    content->next_in_bucket = segment->buckets[bucket];
+    segment->buckets[bucket] = (int32_t) (content - segment->slots);
+    content->bucket = bucket;
+    count(&segment->stats.entries, 1);
+    count(&segment->stats.bytes, (int64_t) response_len);
+    pthread_mutex_unlock(bucket_lock);
+    return content;
+}
+
+
+void content_cache_report(void) {
+    if (segment == NULL) {
+        return;
+    }
+    struct content_cache_stats* stats = &segment->stats;
+    printf("shared content cache: %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64 " evictions, %" PRIu64 " invalidations, %" PRIu64 " files, %" PRIu64 " of %" PRIu64 " bytes\n",
+           __atomic_load_n(&stats->hits, __ATOMIC_RELAXED), __atomic_load_n(&stats->misses, __ATOMIC_RELAXED),
+           __atomic_load_n(&stats->evictions, __ATOMIC_RELAXED), __atomic_load_n(&stats->invalidations, __ATOMIC_RELAXED),
+           __atomic_load_n(&stats->entries, __ATOMIC_RELAXED), __atomic_load_n(&stats->bytes, __ATOMIC_RELAXED), stats->budget);
+}
@@ -0,0 +1,60 @@
+#ifndef _CONTENT_CACHE_H
+#define _CONTENT_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+/*
+ * content of the hot small files, with the responses to GET already prepared, in a shared memory segment
+ * created before fork() so that every child and worker reuses what the earlier ones loaded
+ */
+#define CONTENT_CACHE_BUDGET (64 << 20)             /* default budget in bytes, -b on the command line */
+#define CONTENT_CACHE_MAX_FILE (256 * 1024)         /* larger files are always sent from the file */
+#define CONTENT_CACHE_BUCKETS 4096
+#define CONTENT_CACHE_LOCKS 64                      /* bucket i is guarded by lock i % CONTENT_CACHE_LOCKS */
+#define CONTENT_CACHE_CLASSES 5                     /* slot sizes, each one gets the same share of the budget */
+#define CONTENT_CACHE_NAME_LEN 200
+#define CONTENT_CACHE_PINS 8                        /* processes sending the same slot at once, the others use the file */
+#define CONTENT_HEAD_LEN 9                          /* "+OK\r\n" and the 32 bit size, legacy format */
+#define CONTENT_HEAD_V2_LEN 29                      /* "+OK\r\n", length, size and time in nanoseconds, v2 format */
+
+/* a slot of the segment, the mapping is inherited by the children so its pointers are valid in all of them */
+struct cached_content {
+    int32_t next_in_bucket;                         /* slot index, -1 ends the chain */
+    int32_t bucket;                                 /* -1 for a free slot, -2 while it is being loaded */
+    uint32_t hash;
+    pid_t loader;                                   /* process loading it while bucket is -2 */
+    pid_t pinned_by[CONTENT_CACHE_PINS];            /* processes sending it, 0 for an unused pin, atomic */
+    uint8_t referenced;                             /* CLOCK bit, set by every hit */
+    char name[CONTENT_CACHE_NAME_LEN];
+    struct stat file_stat;
+    time_t checked;                                 /* CLOCK_MONOTONIC seconds of the last check of file_stat */
+    uint64_t file_size;
+    char head_v2[CONTENT_HEAD_V2_LEN];
+    size_t response_len;
+    char* response;                                 /* legacy response: head, content, timestamp */
+};
+
+struct content_cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t invalidations;
+    uint64_t entries;
+    uint64_t bytes;
+    uint64_t budget;
+};
+
+void content_cache_init(size_t budget);
+struct cached_content* content_cache_get(const char* file_name);
+struct cached_content* content_cache_load(const char* file_name, int file_fd, const struct stat* file_stat);
+void content_cache_release(struct cached_content* content);
+void content_cache_drop(const char* file_name);
+void content_cache_drop_all(void);
+void content_cache_report(void);
+
+#endif
@@ -0,0 +1,403 @@
+/*
+ *  Cache of open files and of their stat()
+ *
+ *  Entries are invalidated by the inotify events of the served directory, the files in subdirectories by
+ *  checking their stat() again after FILE_CACHE_TTL seconds. Each process has its own cache: file_cache_init()
+ *  must be called again after fork().
+ *
+ *  Names that do not exist are remembered for FILE_CACHE_MISS_TTL_MS, so a client asking again and again for a
+ *  missing file is answered without a path lookup; the inotify event of its creation forgets them at once.
+ *
+ *  Names are resolved relative to the served directory, opened once by file_cache_set_root(), with openat2() and
+ *  RESOLVE_BENEATH: "..", absolute paths and symbolic links cannot lead a client out of it.
+ *
+ *  The files in the packs opened by pack_file_open() are served first, from the descriptor of their pack.
+ *
+ *  With file_cache_index_tree() every directory of the tree is watched and indexed by file_index.c: the files in
+ *  subdirectories are invalidated by their events too, and the names that are not in the index are missing.
+ *
+ */
+
+#define     _GNU_SOURCE
+#include    <stdlib.h>
+#include    <stdio.h>
+#include    <string.h>
+#include    <errno.h>
+#include    <unistd.h>
+#include    <fcntl.h>
+#include    <sys/inotify.h>
+#include    <sys/syscall.h>
+#include    <linux/openat2.h>
+#include    "file_cache.h"
+#include    "content_cache.h"
+#include    "file_index.h"
+#include    "pack_file.h"
+
+#define INOTIFY_MASK (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+
+static struct cached_file entries[FILE_CACHE_ENTRIES];
+static struct missing_file missing[FILE_CACHE_MISSES];
+static int next_missing = 0;
+static int inotify_fd = -1;
+static int root_wd = -1;            /* watch of the served directory */
+static int root_fd = AT_FDCWD;
+static const char* root_path = ".";
+static int initialized = 0;
+static uint64_t uses = 0;
+
+
+/* closes the descriptor of file, unless it is the one of its pack */
+static void close_file(struct cached_file* file) {
+    if (!file->packed) {
+        close(file->file_fd);
+    }
+}
+
+
+static void drop_entry(struct cached_file* file) {
+    if (file->users > 0) {
+        file->stale = 1;
+        return;
+    }
+    close_file(file);
+    file->file_fd = -1;
+}
+
+
+static void forget_missing(const char* file_name) {
+    for (int a = 0; a < FILE_CACHE_MISSES; a++) {
+        if (missing[a].missed_ms != 0 && (file_name == NULL || strcmp(missing[a].name, file_name) == 0)) {
+            missing[a].missed_ms = 0;
+        }
+    }
+}
+
+
+/* returns 1 if file_name did not exist less than FILE_CACHE_MISS_TTL_MS ago */
+static int known_missing(const char* file_name, uint64_t now_ms) {
+    for (int a = 0; a < FILE_CACHE_MISSES; a++) {
+        if (missing[a].missed_ms != 0 && strcmp(missing[a].name, file_name) == 0) {
+            if (now_ms - missing[a].missed_ms < FILE_CACHE_MISS_TTL_MS) {
+                return 1;
+            }
+            missing[a].missed_ms = 0;
+            return 0;
+        }
+    }
+    return 0;
+}
+
+
+static void remember_missing(const char* file_name, uint64_t now_ms) {
+    size_t name_len = strlen(file_name);
+    if (name_len >= FILE_CACHE_NAME_LEN) {
+        return;
+    }
+    /* the oldest name makes room for the new one */
+    memcpy(missing[next_missing].name, file_name, name_len + 1);
+    missing[next_missing].missed_ms = now_ms;
+    next_missing = (next_missing + 1) % FILE_CACHE_MISSES;
+}
+
+
+/* opens the directory served, once before the first file_cache_init(). returns -1 if it is not a directory */
+int file_cache_set_root(const char* path) {
+    int fd = open(path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    root_fd = fd;
+    root_path = path;
+    return 0;
+}
+
+
+void file_cache_init(void) {
+    for (int a = 0; a < FILE_CACHE_ENTRIES; a++) {
+        if (initialized && entries[a].file_fd >= 0) {
+            /* inherited from the parent process */
+            close_file(&entries[a]);
+        }
+        entries[a].file_fd = -1;
+        entries[a].users = 0;
+    }
+    forget_missing(NULL);
+    if (inotify_fd >= 0) {
+        /* inherited from the parent process, which keeps reading it */
+        close(inotify_fd);
+    }
+
+    initialized = 1;
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd >= 0 && (root_wd = inotify_add_watch(inotify_fd, root_path, INOTIFY_MASK)) < 0) {
+        close(inotify_fd);
+        inotify_fd = -1;
+    }
+}
+
+
+/*
+ * indexes the whole served tree with threads threads, or maps the snapshot at snapshot_path (NULL for none) left by
+ * an earlier run, after file_cache_set_root() and file_cache_init(). returns -1 if it cannot
+ */
+int file_cache_index_tree(int threads, const char* snapshot_path) {
+    if (inotify_fd < 0) {
+        printf("inotify is not available - files are looked up on the file system.\n");
+        return -1;
+    }
+    return file_index_build(root_fd, inotify_fd, INOTIFY_MASK, threads, snapshot_path);
+}
+
+
+/* drops every entry, here and in the content cache */
+static void drop_all(void) {
+    for (int a = 0; a < FILE_CACHE_ENTRIES; a++) {
+        if (entries[a].file_fd >= 0 && !entries[a].stale) {
+            drop_entry(&entries[a]);
+        }
+    }
+    content_cache_drop_all();
+    forget_missing(NULL);
+}
+
+
+/* drops the entries of the files changed since the last call, here and in the content cache */
+void file_cache_poll_events(void) {
+    if (inotify_fd < 0) {
+        return;
+    }
+
+    char events[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+
+    while ((len = read(inotify_fd, events, sizeof(events))) > 0) {
+        for (char* cursor = events; cursor < events + len; ) {
+            struct inotify_event* event = (struct inotify_event*) cursor;
+            cursor += sizeof(struct inotify_event) + event->len;
+
+            if ((event->mask & IN_Q_OVERFLOW) || ((event->mask & IN_IGNORED) && event->wd == root_wd)) {
+                /* events lost, or the directory is not watched anymore: drop everything */
+                drop_all();
+                if (event->mask & IN_IGNORED) {
+                    file_index_stop();
+                    close(inotify_fd);
+                    inotify_fd = -1;
+                    return;
+                }
+                file_index_rebuild();
+                continue;
+            }
+            if (event->mask & IN_IGNORED) {
+                /* a subdirectory of the index was removed */
+                file_index_forget_watch(event->wd);
+                continue;
+            }
+            if (event->len == 0) {
+                continue;
+            }
+
+            /* the name of the file relative to the served directory */
+            const char* name = event->name;
+            char path[FILE_CACHE_NAME_LEN];
+            if (event->wd != root_wd) {
+                const char* directory = file_index_directory(event->wd);
+                if (directory == NULL || snprintf(path, sizeof(path), "%s/%s", directory, event->name) >= (int) sizeof(path)) {
+                    continue;
+                }
+                name = path;
+            }
+            file_index_event(name, event->mask);
+            if ((event->mask & IN_ISDIR) && (event->mask & (IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO))) {
+                /* the names of all the files inside have changed */
+                drop_all();
+                continue;
+            }
+            content_cache_drop(name);
+            forget_missing(name);
+            for (int a = 0; a < FILE_CACHE_ENTRIES; a++) {
+                if (entries[a].file_fd >= 0 && !entries[a].stale && strcmp(entries[a].name, name) == 0) {
+                    drop_entry(&entries[a]);
+                }
+            }
+        }
+    }
+}
+
+
+/* returns 1 if the changes to file_name are reported by inotify */
+int file_cache_watches(const char* file_name) {
+    return inotify_fd >= 0 && (strchr(file_name, '/') == NULL || file_index_covers(file_name));
+}
+
+
+/* returns 1 if file_name is not the file described by file_stat anymore */
+int file_cache_changed(const char* file_name, const struct stat* file_stat) {
+    struct stat current;
+    return fstatat(root_fd, file_name, &current, 0) != 0 || current.st_ino != file_stat->st_ino || current.st_dev != file_stat->st_dev ||
+           current.st_size != file_stat->st_size || current.st_mtim.tv_sec != file_stat->st_mtim.tv_sec ||
+           current.st_mtim.tv_nsec != file_stat->st_mtim.tv_nsec;
+}
+
+
+/* returns 1 if file_name still is the file of the entry */
+static int still_valid(struct cached_file* file, const char* file_name, time_t now) {
+    if (file->packed || file_cache_watches(file_name)) {
+        /* file_cache_poll_events() has already dropped it otherwise */
+        return 1;
+    }
+    if (now - file->checked < FILE_CACHE_TTL) {
+        return 1;
+    }
+    if (file_cache_changed(file_name, &file->file_stat)) {
+        return 0;
+    }
+    file->checked = now;
+    return 1;
+}
+
+
+/* opens file_name in the served directory, failing with EXDEV if it would leave it */
+static int open_beneath(const char* file_name) {
+    struct open_how how;
+    memset(&how, 0, sizeof(how));
+    how.flags = O_RDONLY | O_CLOEXEC;
+    how.resolve = RESOLVE_BENEATH;
+    int file_fd = (int) syscall(SYS_openat2, root_fd, file_name, &how, sizeof(how));
+    if (file_fd >= 0 || errno != ENOSYS) {
+        return file_fd;
+    }
+
+    /* kernel older than 5.6: reject the names that obviously leave the directory, symbolic links are followed */
+    const char* component = file_name;
+    while (component != NULL) {
+        if (component[0] == '/' || (component[0] == '.' && component[1] == '.' && (component[2] == '/' || component[2] == '\0'))) {
+            errno = EXDEV;
+            return -1;
+        }
+        component = strchr(component, '/');
+        component = component != NULL ? component + 1 : NULL;
+    }
+    return openat(root_fd, file_name, O_RDONLY | O_CLOEXEC);
+}
+
+
+/*
+ * returns the entry of file_name, opened and with its stat(), or NULL if there is no such regular file.
+ * the entry stays valid until file_cache_release().
+ */
+struct cached_file* file_cache_open(const char* file_name) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    file_cache_poll_events();
+
+    struct cached_file* victim = NULL;
+    for (int a = 0; a < FILE_CACHE_ENTRIES; a++) {
+        struct cached_file* file = &entries[a];
+        if (file->file_fd < 0 || file->stale) {
+            if (file->file_fd < 0 && victim == NULL) {
+                victim = file;
+            }
+            continue;
+        }
+        if (strcmp(file->name, file_name) == 0) {
+            if (still_valid(file, file_name, now.tv_sec)) {
+                file->users++;
+                file->last_used = ++uses;
+                return file;
+            }
+            drop_entry(file);
+            if (file->file_fd < 0 && victim == NULL) {
+                victim = file;
+            }
+            continue;
+        }
+        if (file->users == 0 && (victim == NULL || (victim->file_fd >= 0 && file->last_used < victim->last_used))) {
+            /* least recently used entry */
+            victim = file;
+        }
+    }
+
+    /* not cached: find the file in the packs, or open it unless it was just found missing or it is not in the index */
+    size_t name_len = strlen(file_name);
+    int file_fd;
+    uint64_t offset = 0;
+    int packed = 0;
+    struct stat file_stat;
+    const struct pack_record* record;
+    if (pack_file_lookup(file_name, &file_fd, &record)) {
+        memset(&file_stat, 0, sizeof(file_stat));
+        file_stat.st_mode = S_IFREG | 0444;
+        file_stat.st_size = (off_t) record->size;
+        file_stat.st_mtim.tv_sec = (time_t) (record->mtime_ns / 1000000000);
+        file_stat.st_mtim.tv_nsec = (long) (record->mtime_ns % 1000000000);
+        offset = record->offset;
+        packed = 1;
+    }
+    else {
+        uint64_t now_ms = (uint64_t) now.tv_sec * 1000 + (uint64_t) now.tv_nsec / 1000000;
+        if (known_missing(file_name, now_ms) || file_index_lookup(file_name) == 0) {
+            return NULL;
+        }
+        file_fd = open_beneath(file_name);
+        if (file_fd < 0) {
+            if (errno == ENOENT || errno == ENOTDIR || errno == EACCES || errno == EISDIR || errno == EXDEV) {
+                /* not worth remembering transient failures, like running out of descriptors */
+                remember_missing(file_name, now_ms);
+            }
+            return NULL;
+        }
+        if (fstat(file_fd, &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
+            close(file_fd);
+            remember_missing(file_name, now_ms);
+            return NULL;
+        }
+        if (file_stat.st_size >= FILE_CACHE_SEQUENTIAL_LEN) {
+            /* served whole, from front to back: a readahead window twice as large */
+            posix_fadvise(file_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        }
+    }
+
+    if (victim == NULL || name_len >= FILE_CACHE_NAME_LEN) {
+        victim = malloc(sizeof(*victim));
+        if (victim == NULL) {
+            if (!packed) {
+                close(file_fd);
+            }
+            return NULL;
+        }
+        victim->uncached = 1;
+        victim->name[0] = '\0';
+    }
+    else {
+        if (victim->file_fd >= 0) {
+            close_file(victim);
+        }
+        victim->uncached = 0;
+        memcpy(victim->name, file_name, name_len + 1);
+    }
+    victim->file_fd = file_fd;
+    victim->offset = offset;
+    victim->packed = packed;
+    victim->file_stat = file_stat;
+    victim->checked = now.tv_sec;
+    victim->last_used = ++uses;
+    victim->users = 1;
+    victim->stale = 0;
+    return victim;
+}
+
+
+void file_cache_release(struct cached_file* file) {
+    if (--file->users > 0) {
+        return;
+    }
+    if (file->uncached) {
+        close_file(file);
+        free(file);
+    }
+    else if (file->stale) {
+        close_file(file);
+        file->file_fd = -1;
+        file->stale = 0;
+    }
+}
@@ -0,0 +1,46 @@
+#ifndef _FILE_CACHE_H
+#define _FILE_CACHE_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include <time.h>
+
+/* open files kept by the server with their stat(), so that a hot file is served without any path lookup */
+#define FILE_CACHE_ENTRIES 64
+#define FILE_CACHE_NAME_LEN 200
+/* seconds after which a file not covered by inotify (in a subdirectory, or inotify not available) is checked again */
+#define FILE_CACHE_TTL 1
+/* files read from front to back with a doubled readahead window from this size */
+#define FILE_CACHE_SEQUENTIAL_LEN (256 * 1024)
+/* names that do not exist are remembered for a while, forgotten earlier if inotify reports their creation */
+#define FILE_CACHE_MISSES 64
+#define FILE_CACHE_MISS_TTL_MS 1000
+
+struct cached_file {
+    char name[FILE_CACHE_NAME_LEN];
+    int file_fd;                    /* -1 for a free entry */
+    uint64_t offset;                /* of the content in file_fd, where a packed file starts in its pack */
+    int packed;                     /* file_fd is a pack, open for as long as the server runs */
+    struct stat file_stat;
+    time_t checked;                 /* CLOCK_MONOTONIC seconds of the last check against the file system */
+    uint64_t last_used;
+    int users;                      /* responses being sent from file_fd */
+    int stale;                      /* the file changed, file_fd is closed when the last user releases it */
+    int uncached;                   /* every entry was in use, the file is closed on release */
+};
+
+struct missing_file {
+    char name[FILE_CACHE_NAME_LEN];
+    uint64_t missed_ms;             /* CLOCK_MONOTONIC milliseconds of the failed lookup, 0 for a free entry */
+};
+
+int file_cache_set_root(const char* path);
+void file_cache_init(void);
+int file_cache_index_tree(int threads, const char* snapshot_path);
+struct cached_file* file_cache_open(const char* file_name);
+void file_cache_release(struct cached_file* file);
+void file_cache_poll_events(void);
+int file_cache_watches(const char* file_name);
+int file_cache_changed(const char* file_name, const struct stat* file_stat);
+
+#endif
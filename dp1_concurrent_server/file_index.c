@@ -0,0 +1,1009 @@
+/*
+ *  Index of the files of the served tree
+ *
+ *  Built at startup by walking the served directory with a few threads, then kept current by the inotify events
+ *  of every directory of the tree: a file that is not in the index does not exist, and the server answers -ERR
+ *  without any system call. The index is an open addressing hash table with linear probing of fixed-size entries,
+ *  the names are stored one after the other in a separate buffer.
+ *
+ *  Every directory indexed has an entry too, its name followed by '/' ("/" for the served directory), marking that
+ *  the files inside are in the index.
+ *
+ *  With a snapshot, the index of the last run is mapped instead of walking the tree, and each directory is reconciled
+ *  with the file system the first time one of its names is looked up: a directory with the inode and the mtime it
+ *  had before the snapshot was taken holds the same names, which are copied from the snapshot, the other ones are
+ *  read again. The next snapshot is written by a child process from its copy of the index, and carries the
+ *  directories never looked up over from the snapshot mapped, to be reconciled on their first lookup after a restart.
+ *
+ */
+
+#define     _GNU_SOURCE
+#include    <stdlib.h>
+#include    <string.h>
+#include    <stdio.h>
+#include    <errno.h>
+#include    <unistd.h>
+#include    <fcntl.h>
+#include    <dirent.h>
+#include    <time.h>
+#include    <pthread.h>
+#include    <sys/stat.h>
+#include    <sys/mman.h>
+#include    <sys/wait.h>
+#include    <sys/inotify.h>
+#include    "file_index.h"
+#include    "file_cache.h"
+
+/* a file found by the walk */
+struct found_file {
+    char* name;
+    uint64_t inode;
+    uint64_t size;
+    uint64_t mtime_ns;
+};
+
+/* state of the walk shared by its threads */
+struct walk {
+    pthread_mutex_t lock;
+    pthread_cond_t more_work;
+    char** directories;             /* directories to read, relative to the served directory ("" for itself) */
+    size_t n_directories;
+    size_t next_directory;
+    int busy;                       /* threads reading a directory, which can add new ones */
+    struct found_file* files;
+    size_t n_files;
+    size_t files_capacity;
+    int failed;                     /* a directory could not be watched */
+    int lazy;                       /* the subdirectories in the snapshot are left to their first lookup */
+};
+
+static int root_fd = -1;
+static int inotify_fd = -1;
+static uint32_t inotify_mask = 0;
+static int walk_threads = 1;
+static int active = 0;
+static int changed = 0;             /* since the last snapshot */
+
+static struct index_entry* entries = NULL;
+static size_t capacity = 0;         /* power of 2 */
+static size_t used = 0;             /* entries not free, deleted ones included */
+static size_t n_names = 0;          /* files and directories */
+static char* names = NULL;
+static size_t names_len = 0;
+static size_t names_capacity = 0;
+
+static char** watched = NULL;       /* directory of every watch descriptor */
+static int n_watched = 0;
+
+static size_t walked_files = 0;
+static size_t walked_directories = 0;
+
+static const char* snapshot_path = NULL;
+static const struct index_snapshot_header* snapshot = NULL;   /* mapped, until every directory is reconciled */
+static size_t snapshot_len = 0;
+static const struct index_snapshot_directory* snapshot_directories = NULL;
+static const struct index_entry* snapshot_files = NULL;
+static const char* snapshot_names = NULL;
+static time_t saved_at = 0;         /* CLOCK_MONOTONIC seconds of the last snapshot written or mapped */
+static pid_t writer = 0;            /* process writing the snapshot, 0 if there is none */
+static size_t carried_over = 0;     /* directories of the last snapshot written that were not reconciled */
+
+/* a directory or a file of the snapshot written, from the index or carried over from the snapshot mapped */
+struct saved_directory {
+    const char* name;
+    size_t len;
+    const struct index_snapshot_directory* unreconciled;    /* NULL if it is in the index */
+};
+
+struct saved_file {
+    const char* name;
+    const struct index_entry* record;
+};
+
+
+static uint32_t hash_name(const char* name) {
+    /* FNV-1a */
+    uint32_t hash = 2166136261u;
+    for (const unsigned char* c = (const unsigned char*) name; *c != '\0'; ++c) {
+        hash = (hash ^ *c) * 16777619u;
+    }
+    return hash;
+}
+
+
+static uint64_t mtime_of(const struct stat* file_stat) {
+    return (uint64_t) file_stat->st_mtim.tv_sec * 1000000000 + (uint64_t) file_stat->st_mtim.tv_nsec;
+}
+
+
+/* returns the length of the directory of file_name, 0 for the served directory */
+static size_t directory_len(const char* file_name) {
+    const char* last_slash = strrchr(file_name, '/');
+    return last_slash != NULL ? (size_t) (last_slash - file_name) : 0;
+}
+
+
+/* returns the slot of name, or the slot where it would be inserted if it is not in the index */
+static struct index_entry* find_slot(const char* name, uint32_t hash, int* found) {
+    struct index_entry* insert_at = NULL;
+    for (size_t a = hash & (capacity - 1); ; a = (a + 1) & (capacity - 1)) {
+        struct index_entry* entry = &entries[a];
+        if (entry->name == INDEX_FREE) {
+            *found = 0;
+            return insert_at != NULL ? insert_at : entry;
+        }
+        if (entry->name == INDEX_DELETED) {
+            if (insert_at == NULL) {
+                insert_at = entry;
+            }
+            continue;
+        }
+        if (entry->hash == hash && strcmp(&names[entry->name], name) == 0) {
+            *found = 1;
+            return entry;
+        }
+    }
+}
+
+
+static void grow_table(size_t new_capacity) {
+    struct index_entry* old_entries = entries;
+    size_t old_capacity = capacity;
+
+    entries = calloc(new_capacity, sizeof(*entries));
+    if (entries == NULL) {
+        printf("out of memory for the index of the served directory\n");
+        exit(-1);
+    }
+    capacity = new_capacity;
+    used = n_names;
+    for (size_t a = 0; a < old_capacity; a++) {
+        if (old_entries[a].name > INDEX_DELETED) {
+            size_t b = old_entries[a].hash & (capacity - 1);
+            while (entries[b].name != INDEX_FREE) {
+                b = (b + 1) & (capacity - 1);
+            }
+            entries[b] = old_entries[a];
+        }
+    }
+    free(old_entries);
+}
+
+
+static void index_insert(const char* name, uint64_t inode, uint64_t size, uint64_t mtime_ns) {
+    if ((used + 1) * 4 > capacity * 3) {
+        /* at most 3/4 full, deleted entries included */
+        grow_table(n_names * 2 > capacity ? capacity * 2 : capacity);
+    }
+
+    uint32_t hash = hash_name(name);
+    int found;
+    struct index_entry* entry = find_slot(name, hash, &found);
+    if (!found) {
+        size_t name_len = strlen(name) + 1;
+        if (names_len + name_len > names_capacity) {
+            names_capacity = (names_len + name_len) * 2;
+            names = realloc(names, names_capacity);
+            if (names == NULL) {
+                printf("out of memory for the index of the served directory\n");
+                exit(-1);
+            }
+        }
+        memcpy(&names[names_len], name, name_len);
+        used += (entry->name == INDEX_FREE);
+        entry->name = (uint32_t) names_len;
+        entry->hash = hash;
+        names_len += name_len;
+        n_names++;
+    }
+    entry->inode = inode;
+    entry->size = size;
+    entry->mtime_ns = mtime_ns;
+}
+
+
+static void index_remove(const char* name) {
+    int found;
+    struct index_entry* entry = find_slot(name, hash_name(name), &found);
+    if (found) {
+        /* the name stays in the names until the next rebuild */
+        entry->name = INDEX_DELETED;
+        n_names--;
+    }
+}
+
+
+/* removes the files of the directory prefix and of its subdirectories */
+static void index_remove_tree(const char* prefix) {
+    size_t prefix_len = strlen(prefix);
+    for (size_t a = 0; a < capacity; a++) {
+        const char* name = &names[entries[a].name];
+        if (entries[a].name > INDEX_DELETED && strncmp(name, prefix, prefix_len) == 0 && name[prefix_len] == '/') {
+            entries[a].name = INDEX_DELETED;
+            n_names--;
+        }
+    }
+    for (int wd = 0; wd < n_watched; wd++) {
+        if (watched[wd] != NULL && strncmp(watched[wd], prefix, prefix_len) == 0 &&
+            (watched[wd][prefix_len] == '\0' || watched[wd][prefix_len] == '/')) {
+            inotify_rm_watch(inotify_fd, wd);
+            file_index_forget_watch(wd);
+        }
+    }
+}
+
+
+static void join_path(char* path, const char* directory, const char* name) {
+    if (directory[0] == '\0') {
+        snprintf(path, FILE_CACHE_NAME_LEN, "%s", name);
+    }
+    else {
+        snprintf(path, FILE_CACHE_NAME_LEN, "%s/%s", directory, name);
+    }
+}
+
+
+/* watches directory, with the walk locked. returns -1 if it cannot be watched */
+static int watch_directory(const char* directory) {
+    char path[FILE_CACHE_NAME_LEN + 32];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d/%s", root_fd, directory);
+    int wd = inotify_add_watch(inotify_fd, path, inotify_mask | IN_ONLYDIR | IN_DONT_FOLLOW);
+    if (wd < 0) {
+        return -1;
+    }
+    if (wd >= n_watched) {
+        int new_watched = (wd + 1) * 2;
+        watched = realloc(watched, (size_t) new_watched * sizeof(*watched));
+        if (watched == NULL) {
+            return -1;
+        }
+        memset(&watched[n_watched], 0, (size_t) (new_watched - n_watched) * sizeof(*watched));
+        n_watched = new_watched;
+    }
+    if (watched[wd] == NULL) {
+        watched[wd] = strdup(directory);
+    }
+    return 0;
+}
+
+
+/* returns the directory of the snapshot named directory, NULL if it is not in the snapshot */
+static const struct index_snapshot_directory* find_snapshot_directory(const char* directory) {
+    size_t low = 0;
+    size_t high = snapshot->n_directories;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (snapshot_directories[middle].name >= snapshot->names_len) {
+            return NULL;
+        }
+        int order = strcmp(directory, &snapshot_names[snapshot_directories[middle].name]);
+        if (order == 0) {
+            return &snapshot_directories[middle];
+        }
+        if (order < 0) {
+            high = middle;
+        }
+        else {
+            low = middle + 1;
+        }
+    }
+    return NULL;
+}
+
+
+/* reads a directory: its files go to the walk, its subdirectories to the directories still to read */
+static void read_directory(struct walk* walk, const char* directory) {
+    int directory_fd = openat(root_fd, directory[0] == '\0' ? "." : directory, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    DIR* stream = directory_fd >= 0 ? fdopendir(directory_fd) : NULL;
+    if (stream == NULL) {
+        if (directory_fd >= 0) {
+            close(directory_fd);
+        }
+        return;
+    }
+
+    struct dirent* dir_entry;
+    char path[FILE_CACHE_NAME_LEN];
+    while ((dir_entry = readdir(stream)) != NULL) {
+        if (strcmp(dir_entry->d_name, ".") == 0 || strcmp(dir_entry->d_name, "..") == 0) {
+            continue;
+        }
+        if (strlen(directory) + strlen(dir_entry->d_name) + 1 >= FILE_CACHE_NAME_LEN) {
+            /* longer than any name a client can request */
+            continue;
+        }
+        join_path(path, directory, dir_entry->d_name);
+
+        struct stat file_stat;
+        if (dir_entry->d_type == DT_DIR ||
+            (dir_entry->d_type == DT_UNKNOWN && fstatat(directory_fd, dir_entry->d_name, &file_stat, AT_SYMLINK_NOFOLLOW) == 0 &&
+             S_ISDIR(file_stat.st_mode))) {
+            /* symbolic links to directories are not followed, the tree has no loops */
+            if (walk->lazy && find_snapshot_directory(path) != NULL) {
+                continue;
+            }
+            pthread_mutex_lock(&walk->lock);
+            if (watch_directory(path) < 0) {
+                walk->failed = 1;
+            }
+            char** directories = realloc(walk->directories, (walk->n_directories + 1) * sizeof(*directories));
+            if (directories != NULL) {
+                walk->directories = directories;
+                walk->directories[walk->n_directories++] = strdup(path);
+                pthread_cond_signal(&walk->more_work);
+            }
+            pthread_mutex_unlock(&walk->lock);
+            continue;
+        }
+        if (fstatat(directory_fd, dir_entry->d_name, &file_stat, 0) != 0 || !S_ISREG(file_stat.st_mode)) {
+            continue;
+        }
+
+        pthread_mutex_lock(&walk->lock);
+        if (walk->n_files == walk->files_capacity) {
+            walk->files_capacity = walk->files_capacity * 2 + 1024;
+            walk->files = realloc(walk->files, walk->files_capacity * sizeof(*walk->files));
+        }
+        if (walk->files != NULL) {
+            struct found_file* found = &walk->files[walk->n_files++];
+            found->name = strdup(path);
+            found->inode = (uint64_t) file_stat.st_ino;
+            found->size = (uint64_t) file_stat.st_size;
+            found->mtime_ns = mtime_of(&file_stat);
+        }
+        pthread_mutex_unlock(&walk->lock);
+    }
+    closedir(stream);
+}
+
+
+static void* walk_thread(void* arg) {
+    struct walk* walk = arg;
+
+    pthread_mutex_lock(&walk->lock);
+    while (1) {
+        while (walk->next_directory == walk->n_directories && walk->busy > 0) {
+            pthread_cond_wait(&walk->more_work, &walk->lock);
+        }
+        if (walk->next_directory == walk->n_directories) {
+            /* nothing left to read, and no thread can find more */
+            pthread_cond_broadcast(&walk->more_work);
+            break;
+        }
+        char* directory = walk->directories[walk->next_directory++];
+        walk->busy++;
+        pthread_mutex_unlock(&walk->lock);
+
+        read_directory(walk, directory);
+
+        pthread_mutex_lock(&walk->lock);
+        walk->busy--;
+        pthread_cond_broadcast(&walk->more_work);
+    }
+    pthread_mutex_unlock(&walk->lock);
+    return NULL;
+}
+
+
+/* indexes the marker of directory, meaning that its files are in the index */
+static void index_directory(const char* directory) {
+    char marker[FILE_CACHE_NAME_LEN + 1];
+    snprintf(marker, sizeof(marker), "%s/", directory);
+    index_insert(marker, 0, 0, 0);
+}
+
+
+/*
+ * indexes the tree of directory, the whole served tree if it is "". if lazy, the subdirectories in the snapshot
+ * are not read. returns -1 if a directory cannot be watched
+ */
+static int walk_tree(const char* directory, int threads, int lazy) {
+    struct walk walk;
+    memset(&walk, 0, sizeof(walk));
+    walk.lazy = lazy;
+    pthread_mutex_init(&walk.lock, NULL);
+    pthread_cond_init(&walk.more_work, NULL);
+    walk.directories = malloc(sizeof(*walk.directories));
+    walk.directories[0] = strdup(directory);
+    walk.n_directories = 1;
+    if (watch_directory(directory) < 0) {
+        walk.failed = 1;
+    }
+
+    pthread_t workers[threads];
+    int started = 0;
+    for (; started < threads - 1; started++) {
+        if (pthread_create(&workers[started], NULL, walk_thread, &walk) != 0) {
+            break;
+        }
+    }
+    walk_thread(&walk);
+    for (int a = 0; a < started; a++) {
+        pthread_join(workers[a], NULL);
+    }
+
+    for (size_t a = 0; a < walk.n_files; a++) {
+        index_insert(walk.files[a].name, walk.files[a].inode, walk.files[a].size, walk.files[a].mtime_ns);
+        free(walk.files[a].name);
+    }
+    for (size_t a = 0; a < walk.n_directories; a++) {
+        index_directory(walk.directories[a]);
+        free(walk.directories[a]);
+    }
+    walked_files += walk.n_files;
+    walked_directories += walk.n_directories;
+    free(walk.files);
+    free(walk.directories);
+    pthread_mutex_destroy(&walk.lock);
+    pthread_cond_destroy(&walk.more_work);
+    return walk.failed ? -1 : 0;
+}
+
+
+static void reset_index(void) {
+    free(entries);
+    free(names);
+    capacity = 1024;
+    entries = calloc(capacity, sizeof(*entries));
+    used = 0;
+    n_names = 0;
+    names_capacity = 64 * 1024;
+    names = malloc(names_capacity);
+    names_len = INDEX_DELETED + 1;      /* no name starts at INDEX_FREE or INDEX_DELETED */
+    if (entries == NULL || names == NULL) {
+        printf("out of memory for the index of the served directory\n");
+        exit(-1);
+    }
+}
+
+
+static void unmap_snapshot(void) {
+    if (snapshot != NULL) {
+        munmap((void*) snapshot, snapshot_len);
+        snapshot = NULL;
+    }
+}
+
+
+/* maps the snapshot at path. returns -1 if there is none, or if it is not a snapshot of the served directory */
+static int map_snapshot(const char* path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat snapshot_stat, root_stat;
+    const struct index_snapshot_header* header = MAP_FAILED;
+    if (fstat(fd, &snapshot_stat) == 0 && (size_t) snapshot_stat.st_size >= sizeof(*header)) {
+        header = mmap(NULL, (size_t) snapshot_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (header == MAP_FAILED) {
+        return -1;
+    }
+
+    /* the sizes fit in 32 bits like the offsets of the names, their sum cannot overflow */
+    if (memcmp(header->magic, INDEX_SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 || header->version != INDEX_SNAPSHOT_VERSION ||
+        header->record_len != sizeof(struct index_entry) || header->n_directories > UINT32_MAX ||
+        header->n_files > UINT32_MAX || header->names_len == 0 || header->names_len > UINT32_MAX ||
+        sizeof(*header) + header->n_directories * sizeof(*snapshot_directories) + header->n_files * sizeof(*snapshot_files) +
+        header->names_len != (uint64_t) snapshot_stat.st_size ||
+        fstat(root_fd, &root_stat) != 0 || header->root_device != (uint64_t) root_stat.st_dev ||
+        header->root_inode != (uint64_t) root_stat.st_ino) {
+        munmap((void*) header, (size_t) snapshot_stat.st_size);
+        return -1;
+    }
+
+    snapshot = header;
+    snapshot_len = (size_t) snapshot_stat.st_size;
+    snapshot_directories = (const struct index_snapshot_directory*) (header + 1);
+    snapshot_files = (const struct index_entry*) (snapshot_directories + header->n_directories);
+    snapshot_names = (const char*) (snapshot_files + header->n_files);
+    if (snapshot_names[header->names_len - 1] != '\0') {
+        unmap_snapshot();
+        return -1;
+    }
+    /* the directories are read on their first lookup, in no particular order */
+    madvise((void*) snapshot, snapshot_len, MADV_RANDOM);
+    return 0;
+}
+
+
+/* copies the files of the snapshot directory to the index. returns -1 if the snapshot is damaged */
+static int copy_snapshot_directory(const struct index_snapshot_directory* directory) {
+    if (directory->first_file > snapshot->n_files || directory->n_files > snapshot->n_files - directory->first_file) {
+        return -1;
+    }
+    for (uint64_t a = directory->first_file; a < directory->first_file + directory->n_files; a++) {
+        if (snapshot_files[a].name >= snapshot->names_len) {
+            return -1;
+        }
+    }
+    for (uint64_t a = directory->first_file; a < directory->first_file + directory->n_files; a++) {
+        const struct index_entry* file = &snapshot_files[a];
+        index_insert(&snapshot_names[file->name], file->inode, file->size, file->mtime_ns);
+    }
+    return 0;
+}
+
+
+/*
+ * reconciles directory with the file system, after its parent, unless it already is.
+ * returns 1 if its files are in the index, 0 if it does not exist, -1 if it cannot be watched
+ */
+static int reconcile_directory(const char* directory) {
+    char marker[FILE_CACHE_NAME_LEN + 1];
+    snprintf(marker, sizeof(marker), "%s/", directory);
+    int found;
+    find_slot(marker, hash_name(marker), &found);
+    if (found || snapshot == NULL) {
+        /* without a snapshot, every directory is in the index */
+        return found;
+    }
+
+    if (directory[0] != '\0') {
+        /* the parent reports the moves of directory */
+        char parent[FILE_CACHE_NAME_LEN];
+        snprintf(parent, sizeof(parent), "%.*s", (int) directory_len(directory), directory);
+        int parent_found = reconcile_directory(parent);
+        if (parent_found <= 0) {
+            return parent_found;
+        }
+    }
+
+    /* watched before it is compared, so that any change from now on is reported */
+    struct stat directory_stat;
+    if (watch_directory(directory) < 0) {
+        if (errno == ENOENT || errno == ENOTDIR) {
+            return 0;
+        }
+        printf("cannot watch the directory %s - files are looked up on the file system.\n", directory);
+        active = 0;
+        return -1;
+    }
+    if (fstatat(root_fd, directory[0] != '\0' ? directory : ".", &directory_stat, AT_SYMLINK_NOFOLLOW) != 0 ||
+        !S_ISDIR(directory_stat.st_mode)) {
+        return 0;
+    }
+
+    const struct index_snapshot_directory* snapshot_directory = find_snapshot_directory(directory);
+    if (snapshot_directory != NULL && snapshot_directory->inode == (uint64_t) directory_stat.st_ino &&
+        snapshot_directory->mtime_ns == mtime_of(&directory_stat) && snapshot_directory->mtime_ns < snapshot->taken_ns &&
+        copy_snapshot_directory(snapshot_directory) == 0) {
+        /*
+         * the same names as in the snapshot. the inode, size and mtime of the files can be older than theirs, only
+         * their names are answered from the index
+         */
+        index_directory(directory);
+        return 1;
+    }
+
+    changed = 1;
+    if (walk_tree(directory, 1, 1) < 0) {
+        printf("cannot watch the directories in %s - files are looked up on the file system.\n", directory);
+        active = 0;
+        return -1;
+    }
+    return 1;
+}
+
+
+/* orders directory names like strcmp() */
+static int compare_directories(const char* a, size_t a_len, const char* b, size_t b_len) {
+    int order = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    if (order != 0 || a_len == b_len) {
+        return order;
+    }
+    return a_len < b_len ? -1 : 1;
+}
+
+
+/* orders the directories by their names */
+static int compare_saved_directories(const void* a, const void* b) {
+    const struct saved_directory* directory_a = a;
+    const struct saved_directory* directory_b = b;
+    return compare_directories(directory_a->name, directory_a->len, directory_b->name, directory_b->len);
+}
+
+
+/* orders the files by directory, in the order of compare_saved_directories(), then by name */
+static int compare_saved_files(const void* a, const void* b) {
+    const char* name_a = ((const struct saved_file*) a)->name;
+    const char* name_b = ((const struct saved_file*) b)->name;
+    int order = compare_directories(name_a, directory_len(name_a), name_b, directory_len(name_b));
+    return order != 0 ? order : strcmp(name_a, name_b);
+}
+
+
+/*
+ * adds the directories of the snapshot mapped that are not reconciled, and still exist, with their files as they
+ * were: their inode and mtime in the snapshot tell the next startup whether the files are still the same
+ */
+static void carry_over_unreconciled(struct saved_directory* directories, size_t* n_directories, struct saved_file* files,
+                                    size_t* n_files) {
+    for (uint64_t a = 0; a < snapshot->n_directories; a++) {
+        const struct index_snapshot_directory* directory = &snapshot_directories[a];
+        if (directory->name >= snapshot->names_len || directory->first_file > snapshot->n_files ||
+            directory->n_files > snapshot->n_files - directory->first_file) {
+            continue;
+        }
+        const char* name = &snapshot_names[directory->name];
+        char marker[FILE_CACHE_NAME_LEN + 1];
+        struct stat directory_stat;
+        int found;
+        snprintf(marker, sizeof(marker), "%s/", name);
+        find_slot(marker, hash_name(marker), &found);
+        if (found || fstatat(root_fd, name[0] != '\0' ? name : ".", &directory_stat, AT_SYMLINK_NOFOLLOW) != 0) {
+            continue;
+        }
+
+        int damaged = 0;
+        for (uint64_t b = directory->first_file; b < directory->first_file + directory->n_files; b++) {
+            damaged |= snapshot_files[b].name >= snapshot->names_len;
+        }
+        if (damaged) {
+            continue;
+        }
+        directories[*n_directories].name = name;
+        directories[*n_directories].len = strlen(name);
+        directories[(*n_directories)++].unreconciled = directory;
+        for (uint64_t b = directory->first_file; b < directory->first_file + directory->n_files; b++) {
+            files[*n_files].name = &snapshot_names[snapshot_files[b].name];
+            files[(*n_files)++].record = &snapshot_files[b];
+        }
+    }
+}
+
+
+/* writes the index to snapshot_path, through a temporary file renamed over it. returns -1 on failure */
+static int write_snapshot(uint64_t taken_ns) {
+    struct stat root_stat;
+    if (fstat(root_fd, &root_stat) != 0) {
+        return -1;
+    }
+
+    size_t n_directories = 0, n_files = 0;
+    size_t directories_capacity = n_names + 1 + (snapshot != NULL ? (size_t) snapshot->n_directories : 0);
+    size_t files_capacity = n_names + 1 + (snapshot != NULL ? (size_t) snapshot->n_files : 0);
+    struct saved_directory* directories = malloc(directories_capacity * sizeof(*directories));
+    struct saved_file* files = malloc(files_capacity * sizeof(*files));
+    if (directories == NULL || files == NULL) {
+        free(directories);
+        free(files);
+        return -1;
+    }
+    for (size_t a = 0; a < capacity; a++) {
+        if (entries[a].name > INDEX_DELETED) {
+            const char* name = &names[entries[a].name];
+            size_t len = strlen(name);
+            if (name[len - 1] == '/') {
+                /* the marker of a directory, without its '/' */
+                directories[n_directories].name = name;
+                directories[n_directories].len = len - 1;
+                directories[n_directories++].unreconciled = NULL;
+            }
+            else {
+                files[n_files].name = name;
+                files[n_files++].record = &entries[a];
+            }
+        }
+    }
+    size_t reconciled = n_directories;
+    if (snapshot != NULL) {
+        carry_over_unreconciled(directories, &n_directories, files, &n_files);
+    }
+    qsort(directories, n_directories, sizeof(*directories), compare_saved_directories);
+    qsort(files, n_files, sizeof(*files), compare_saved_files);
+
+    char temporary[FILE_CACHE_NAME_LEN + 32];
+    snprintf(temporary, sizeof(temporary), "%s.%d", snapshot_path, getpid());
+    FILE* out = fopen(temporary, "w");
+    if (out == NULL) {
+        free(directories);
+        free(files);
+        return -1;
+    }
+
+    struct index_snapshot_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = INDEX_SNAPSHOT_VERSION;
+    header.record_len = sizeof(struct index_entry);
+    header.root_device = (uint64_t) root_stat.st_dev;
+    header.root_inode = (uint64_t) root_stat.st_ino;
+    header.taken_ns = taken_ns;
+    header.n_directories = n_directories;
+    header.n_files = n_files;
+    for (size_t a = 0; a < n_directories; a++) {
+        header.names_len += directories[a].len + 1;
+    }
+    for (size_t a = 0; a < n_files; a++) {
+        header.names_len += strlen(files[a].name) + 1;
+    }
+    int failed = header.names_len > UINT32_MAX || fwrite(&header, sizeof(header), 1, out) != 1;
+
+    uint64_t name = 0;
+    size_t next_file = 0;
+    for (size_t a = 0; a < n_directories && !failed; a++) {
+        const char* directory = directories[a].name;
+        size_t len = directories[a].len;
+        struct index_snapshot_directory record;
+        memset(&record, 0, sizeof(record));
+        record.name = (uint32_t) name;
+
+        /* the files of the directory follow those of the previous one */
+        while (next_file < n_files && compare_directories(files[next_file].name, directory_len(files[next_file].name), directory, len) < 0) {
+            next_file++;
+        }
+        record.first_file = next_file;
+        while (next_file < n_files && compare_directories(files[next_file].name, directory_len(files[next_file].name), directory, len) == 0) {
+            next_file++;
+        }
+        record.n_files = (uint32_t) (next_file - record.first_file);
+
+        /* a directory changed after taken_ns, since the events were read, is read again at the next startup */
+        char path[FILE_CACHE_NAME_LEN + 1];
+        struct stat directory_stat;
+        snprintf(path, sizeof(path), "%.*s", (int) len, directory);
+        if (directories[a].unreconciled != NULL) {
+            /* not compared since the last snapshot: compared at the next startup with what it was then */
+            record.inode = directories[a].unreconciled->inode;
+            record.mtime_ns = directories[a].unreconciled->mtime_ns;
+        }
+        else if (fstatat(root_fd, len > 0 ? path : ".", &directory_stat, AT_SYMLINK_NOFOLLOW) == 0) {
+            record.inode = (uint64_t) directory_stat.st_ino;
+            record.mtime_ns = mtime_of(&directory_stat);
+        }
+        else {
+            record.mtime_ns = taken_ns;
+        }
+        failed = fwrite(&record, sizeof(record), 1, out) != 1;
+        name += len + 1;
+    }
+    for (size_t a = 0; a < n_files && !failed; a++) {
+        struct index_entry record = *files[a].record;
+        record.name = (uint32_t) name;
+        failed = fwrite(&record, sizeof(record), 1, out) != 1;
+        name += strlen(files[a].name) + 1;
+    }
+    for (size_t a = 0; a < n_directories && !failed; a++) {
+        size_t len = directories[a].len;
+        failed = (len > 0 && fwrite(directories[a].name, len, 1, out) != 1) || fputc('\0', out) == EOF;
+    }
+    for (size_t a = 0; a < n_files && !failed; a++) {
+        failed = fwrite(files[a].name, strlen(files[a].name) + 1, 1, out) != 1;
+    }
+
+    free(directories);
+    free(files);
+    failed = fclose(out) != 0 || failed;
+    if (failed || rename(temporary, snapshot_path) != 0) {
+        unlink(temporary);
+        return -1;
+    }
+    walked_files = n_files;
+    walked_directories = n_directories;
+    carried_over = n_directories - reconciled;
+    return 0;
+}
+
+
+/*
+ * indexes the served tree with threads threads, watching all its directories on inotify_fd, or maps the snapshot
+ * at snapshot_path if there is one. returns -1 if the tree cannot be indexed completely: the files are then looked
+ * up on the file system.
+ */
+int file_index_build(int served_fd, int events_fd, uint32_t mask, int threads, const char* path) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    root_fd = served_fd;
+    inotify_fd = events_fd;
+    inotify_mask = mask;
+    walk_threads = threads;
+    snapshot_path = path;
+    reset_index();
+    if (snapshot_path != NULL && map_snapshot(snapshot_path) == 0) {
+        active = 1;
+        saved_at = start.tv_sec;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        printf("mapped the index snapshot %s in %.3f ms: %llu files in %llu directories, reconciled on their first lookup\n",
+               snapshot_path, (double) (end.tv_sec - start.tv_sec) * 1e3 + (double) (end.tv_nsec - start.tv_nsec) / 1e6,
+               (unsigned long long) snapshot->n_files, (unsigned long long) snapshot->n_directories);
+        return 0;
+    }
+
+    changed = 1;
+    active = walk_tree("", threads, 0) == 0;
+    if (!active) {
+        printf("cannot watch all the directories served - files are looked up on the file system.\n");
+        return -1;
+    }
+
+    /* the names only grow again with the files created from now on */
+    char* fitting = realloc(names, names_len);
+    if (fitting != NULL) {
+        names = fitting;
+        names_capacity = names_len;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    size_t memory = capacity * sizeof(*entries) + names_capacity;
+    printf("indexed %zu files in %zu directories in %.1f ms with %d threads: %zu bytes, %.1f bytes per name (%zu per entry and %.1f of name)\n",
+           walked_files, walked_directories,
+           (double) (end.tv_sec - start.tv_sec) * 1e3 + (double) (end.tv_nsec - start.tv_nsec) / 1e6, threads,
+           memory, n_names > 0 ? (double) memory / (double) n_names : 0.0, sizeof(*entries),
+           n_names > 0 ? (double) (names_len - INDEX_DELETED - 1) / (double) n_names : 0.0);
+    return 0;
+}
+
+
+/* events lost: walk the tree again */
+void file_index_rebuild(void) {
+    if (active) {
+        unmap_snapshot();
+        reset_index();
+        changed = 1;
+        active = walk_tree("", walk_threads, 0) == 0;
+    }
+}
+
+
+/* no more events: files are looked up on the file system from now on */
+void file_index_stop(void) {
+    active = 0;
+    unmap_snapshot();
+}
+
+
+/*
+ * writes the snapshot of the index if it changed and the last one is INDEX_SNAPSHOT_INTERVAL seconds old, between
+ * two connections. A child process writes it from its copy of the index, the server goes on serving meanwhile.
+ */
+void file_index_save(void) {
+    struct timespec now, end;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (writer > 0) {
+        int status;
+        pid_t done = waitpid(writer, &status, WNOHANG);
+        if (done == 0) {
+            return;
+        }
+        if (done < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            /* written again at the next interval */
+            changed = 1;
+        }
+        writer = 0;
+    }
+    if (!active || snapshot_path == NULL || !changed || (saved_at != 0 && now.tv_sec - saved_at < INDEX_SNAPSHOT_INTERVAL)) {
+        return;
+    }
+    saved_at = now.tv_sec;
+
+    /* any change older than taken_ns is in the index once the events pending are read */
+    struct timespec taken;
+    clock_gettime(CLOCK_REALTIME, &taken);
+    file_cache_poll_events();
+    if (!active) {
+        return;
+    }
+    changed = 0;
+    fflush(stdout);
+    writer = fork();
+    if (writer < 0) {
+        printf("fork() for the index snapshot writer failed\n");
+        writer = 0;
+        changed = 1;
+        return;
+    }
+    if (writer > 0) {
+        return;
+    }
+
+    /* child process: the index is the one of the parent at fork(), the events are the parent's */
+    if (write_snapshot((uint64_t) taken.tv_sec * 1000000000 + (uint64_t) taken.tv_nsec) < 0) {
+        printf("cannot write the index snapshot %s\n", snapshot_path);
+        fflush(stdout);
+        _exit(1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("wrote the index snapshot %s in %.1f ms: %zu files in %zu directories, %zu of them not reconciled yet\n",
+           snapshot_path, (double) (end.tv_sec - now.tv_sec) * 1e3 + (double) (end.tv_nsec - now.tv_nsec) / 1e6,
+           walked_files, walked_directories, carried_over);
+    fflush(stdout);
+    _exit(0);
+}
+
+
+/* returns 1 for the names as the walk builds them, 0 for "sub/../name", "./name", "sub//name" or "/name" */
+static int canonical_name(const char* file_name) {
+    const char* component = file_name;
+    while (component != NULL) {
+        if (component[0] == '\0' || component[0] == '/' || (component[0] == '.' && (component[1] == '/' || component[1] == '\0')) ||
+            (component[0] == '.' && component[1] == '.' && (component[2] == '/' || component[2] == '\0'))) {
+            return 0;
+        }
+        component = strchr(component, '/');
+        component = component != NULL ? component + 1 : NULL;
+    }
+    return 1;
+}
+
+
+/*
+ * returns 1 if the changes to file_name are reported by the inotify events of the tree: only for canonical names,
+ * the other ones are looked up on the file system, and with a snapshot once their directory is reconciled.
+ */
+int file_index_covers(const char* file_name) {
+    if (!active || !canonical_name(file_name)) {
+        return 0;
+    }
+    if (snapshot != NULL) {
+        char marker[FILE_CACHE_NAME_LEN + 1];
+        snprintf(marker, sizeof(marker), "%.*s/", (int) directory_len(file_name), file_name);
+        int found;
+        find_slot(marker, hash_name(marker), &found);
+        return found;
+    }
+    return 1;
+}
+
+
+/* returns 1 if file_name is in the index, 0 if it is not, -1 if the index cannot tell */
+int file_index_lookup(const char* file_name) {
+    if (!active || !canonical_name(file_name)) {
+        return -1;
+    }
+    if (snapshot != NULL) {
+        char directory[FILE_CACHE_NAME_LEN];
+        snprintf(directory, sizeof(directory), "%.*s", (int) directory_len(file_name), file_name);
+        int reconciled = reconcile_directory(directory);
+        if (reconciled <= 0) {
+            return reconciled;
+        }
+    }
+
+    int found;
+    find_slot(file_name, hash_name(file_name), &found);
+    return found;
+}
+
+
+/* returns the directory watched by wd, relative to the served directory, NULL if it is not watched */
+const char* file_index_directory(int wd) {
+    return active && wd >= 0 && wd < n_watched ? watched[wd] : NULL;
+}
+
+
+void file_index_forget_watch(int wd) {
+    if (wd >= 0 && wd < n_watched && watched[wd] != NULL) {
+        free(watched[wd]);
+        watched[wd] = NULL;
+    }
+}
+
+
+/* applies the inotify event about file_name, relative to the served directory */
+void file_index_event(const char* file_name, uint32_t mask) {
+    if (!active) {
+        return;
+    }
+    if (mask & IN_ISDIR) {
+        if (mask & (IN_DELETE | IN_MOVED_FROM)) {
+            index_remove_tree(file_name);
+        }
+        if ((mask & (IN_CREATE | IN_MOVED_TO)) && walk_tree(file_name, 1, 0) < 0) {
+            printf("cannot watch the new directory %s - files are looked up on the file system.\n", file_name);
+            active = 0;
+        }
+        return;
+    }
+
+    changed = 1;
+    struct stat file_stat;
+    if (fstatat(root_fd, file_name, &file_stat, 0) == 0 && S_ISREG(file_stat.st_mode)) {
+        index_insert(file_name, (uint64_t) file_stat.st_ino, (uint64_t) file_stat.st_size, mtime_of(&file_stat));
+    }
+    else {
+        index_remove(file_name);
+    }
+}
@@ -0,0 +1,43 @@
+#ifndef _REQUEST_PARSER_H
+#define _REQUEST_PARSER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define REQUEST_BUFFER_LEN 4096     /* longest request, with the ones pipelined after it */
+#define MAX_LEN_FILE_NAME 200       /* including the terminating '\0' */
+
+#define REQUEST_GET     0
+#define REQUEST_RANGE   1
+#define REQUEST_RESUME  2
+#define REQUEST_HELLO   3           /* "HELO 2\r\n": the client understands the v2 response format */
+#define REQUEST_MULTIPLEXED 4       /* "MGET <id> <file name>\r\n", answered in frames out of order */
+#define REQUEST_NONE    -1
+
+/*
+ * part of the file to send: the whole file for GET, the bytes [offset, offset + length) for GETR, the bytes from
+ * offset to the end for RESM, as long as the file still has the timestamp of the interrupted transfer.
+ */
+struct file_range {
+    int type;                       /* REQUEST_* */
+    uint64_t offset;
+    uint64_t length;
+    uint64_t timestamp;             /* RESM only, as sent by send_file(). 0 accepts any version of the file */
+    uint32_t id;                    /* MGET only */
+};
+
+/* bytes received from a client, parsed in place one request at a time */
+struct request_parser {
+    char buffer[REQUEST_BUFFER_LEN];
+    size_t start;                   /* first byte of the next request */
+    size_t len;                     /* end of the bytes received */
+    size_t scanned;                 /* bytes after start already checked, none of them a control character */
+};
+
+void request_parser_init(struct request_parser* parser);
+int request_parser_next(struct request_parser* parser, struct file_range* range, char** file_name);
+char* request_parser_space(struct request_parser* parser, size_t* available);
+void request_parser_received(struct request_parser* parser, size_t received);
+size_t find_control(const char* bytes, size_t len);
+
+#endif
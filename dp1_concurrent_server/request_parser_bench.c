@@ -0,0 +1,167 @@
+/*
+ *  Microbenchmark of the request parser
+ *
+ *  Parses pipelined synthetic requests from memory, refilled like recv() would in blocks of REQUEST_BUFFER_LEN
+ *  bytes, and prints the millions of requests parsed per second for a few request shapes. It then times
+ *  find_control() against the byte loop it replaces on the same bytes.
+ *
+ *  usage: request_parser_bench [number of requests]
+ *
+ */
+
+#define     _GNU_SOURCE
+#include    <stdlib.h>
+#include    <string.h>
+#include    <stdio.h>
+#include    <time.h>
+#include    "request_parser.h"
+
+#define DEFAULT_REQUESTS (4 * 1024 * 1024)
+#define ROUNDS 3                    /* the best of ROUNDS runs is printed */
+
+
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double) t.tv_sec + (double) t.tv_nsec / 1e9;
+}
+
+
+/* writes n requests of the given shape, returns the stream and its length in *len */
+static char* make_requests(int shape, long n, size_t* len) {
+    size_t capacity = (size_t) n * 96;
+    char* stream = malloc(capacity);
+    if (stream == NULL) {
+        return NULL;
+    }
+
+    size_t used = 0;
+    for (long a = 0; a < n; a++) {
+        switch (shape) {
+        case 0:
+            used += (size_t) sprintf(&stream[used], "GET f%03ld\r\n", a % 1000);
+            break;
+        case 1:
+            used += (size_t) sprintf(&stream[used], "GET dir_%02ld/sub_directory/some_longer_file_name_%06ld.bin\r\n",
+                                     a % 100, a % 1000000);
+            break;
+        default:
+            if (a % 3 == 0) {
+                used += (size_t) sprintf(&stream[used], "GET f%03ld\r\n", a % 1000);
+            }
+            else if (a % 3 == 1) {
+                used += (size_t) sprintf(&stream[used], "GETR %ld %ld data/f%03ld\r\n", a * 4096, 65536L, a % 1000);
+            }
+            else {
+                used += (size_t) sprintf(&stream[used], "RESM %ld 1712345678901234567 data/f%03ld\r\n", a * 512, a % 1000);
+            }
+        }
+    }
+    *len = used;
+    return stream;
+}
+
+
+/* parses the whole stream, returns the number of requests or -1 if one is rejected */
+static long parse_all(const char* stream, size_t len) {
+    static struct request_parser parser;
+    struct file_range range;
+    char* file_name;
+    size_t position = 0;
+    long parsed = 0;
+    int outcome;
+
+    request_parser_init(&parser);
+    for (;;) {
+        while ((outcome = request_parser_next(&parser, &range, &file_name)) == -2) {
+            if (position == len) {
+                return parsed;
+            }
+            size_t available;
+            char* space = request_parser_space(&parser, &available);
+            size_t chunk = len - position < available ? len - position : available;
+            memcpy(space, &stream[position], chunk);
+            request_parser_received(&parser, chunk);
+            position += chunk;
+        }
+        if (outcome < 0) {
+            return -1;
+        }
+        parsed++;
+    }
+}
+
+
+/* the scan of the bytes one at a time, as before find_control() */
+static size_t find_control_bytewise(const char* bytes, size_t len) {
+    for (size_t a = 0; a < len; a++) {
+        unsigned char byte = (unsigned char) bytes[a];
+        if (byte < 0x20 || byte == 0x7f) {
+            return a;
+        }
+    }
+    return len;
+}
+
+
+/* finds every control byte of the stream with find, returns how many there are */
+static long scan_all(const char* stream, size_t len, size_t (*find)(const char*, size_t)) {
+    long found = 0;
+    size_t position = 0;
+    while (position < len) {
+        position += find(&stream[position], len - position) + 1;
+        found++;
+    }
+    return found;
+}
+
+
+int main(int argc, char* argv[]) {
+    long n = argc > 1 ? atol(argv[1]) : DEFAULT_REQUESTS;
+    const char* shapes[] = { "GET fNNN", "GET <50-byte path>", "mixed GET, GETR and RESM" };
+
+    if (n <= 0) {
+        printf("usage: %s [number of requests]\n", argv[0]);
+        return 1;
+    }
+
+    for (int shape = 0; shape < 3; shape++) {
+        size_t len;
+        char* stream = make_requests(shape, n, &len);
+        if (stream == NULL) {
+            printf("cannot allocate the requests\n");
+            return 1;
+        }
+
+        double best_parse = 0, best_vector = 0, best_bytewise = 0;
+        for (int round = 0; round < ROUNDS; round++) {
+            double t0 = now();
+            long parsed = parse_all(stream, len);
+            double t1 = now();
+            long vector = scan_all(stream, len, find_control);
+            double t2 = now();
+            long bytewise = scan_all(stream, len, find_control_bytewise);
+            double t3 = now();
+            if (parsed != n || vector != 2 * n || bytewise != 2 * n) {
+                printf("%s: %ld requests parsed, %ld and %ld control bytes found, expected %ld and %ld\n",
+                       shapes[shape], parsed, vector, bytewise, n, 2 * n);
+                return 1;
+            }
+            if (round == 0 || t1 - t0 < best_parse) {
+                best_parse = t1 - t0;
+            }
+            if (round == 0 || t2 - t1 < best_vector) {
+                best_vector = t2 - t1;
+            }
+            if (round == 0 || t3 - t2 < best_bytewise) {
+                best_bytewise = t3 - t2;
+            }
+        }
+
+        printf("%-26s %6.1f M requests/s, scan %6.0f MB/s with find_control(), %6.0f MB/s bytewise\n",
+               shapes[shape], (double) n / best_parse / 1e6, (double) len / best_vector / 1e6,
+               (double) len / best_bytewise / 1e6);
+        free(stream);
+    }
+    return 0;
+}
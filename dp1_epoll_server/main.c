@@ -0,0 +1,663 @@
+/*
+ *  EVENT-DRIVEN TCP SERVER
+ *  Distributed Programming I
+ *  File transfer TCP server - single process, nonblocking sockets and epoll()
+ *
+ * 	File name: main.c
+ *
+ *  Same GET / +OK / -ERR protocol as the iterative and the concurrent servers, but every connection
+ *  is a small state machine driven by one epoll() loop instead of a blocking process.
+ *  With -t the server runs one such loop per thread ("shard"), each pinned to its own CPU with its own
+ *  SO_REUSEPORT listening socket, connection pool and counters: shards share nothing.
+ *
+ */
+
+#define     _GNU_SOURCE
+#include    <stdlib.h>
+#include    <string.h>
+#include    <inttypes.h>
+#include    <sys/stat.h>
+#include    <errno.h>
+#include    <fcntl.h>
+#include    <time.h>
+#include    <pthread.h>
+#include    <sched.h>
+#include    <signal.h>
+#include    <unistd.h>
+#include    <stdio.h>
+#include    <sys/socket.h>
+#include    <sys/epoll.h>
+#include    <sys/resource.h>
+#include    <sys/sendfile.h>
+#include    <netinet/in.h>
+#include    <arpa/inet.h>
+#include    <netdb.h>
+#include    <limits.h>
+#include    "protocol.h"
+
+
+#define SERVERBUFLEN		4096
+#define MAX_LEN_FILE_NAME 200
+#define MAX_LEN_REQUEST (MAX_LEN_FILE_NAME + 6)     /* "GET " + file name + "\r\n" */
+#define MAX_EVENTS 256
+#define CONNECTION_TIMEOUT 15                       /* seconds, same as the select() timer of the other servers */
+char *program_name;
+int zero_copy = 1;                  /* send files with sendfile(), -c selects the user-space copy loop */
+int n_shards = 0;                   /* event loop threads (-t), 0 runs a single loop in the main thread */
+
+
+enum connection_state {
+    READING_REQUEST,        /* waiting for a complete "GET <file name>\r\n" line */
+    SENDING_HEADER,         /* "+OK\r\n" followed by the size of the file */
+    SENDING_FILE,           /* content of the file */
+    SENDING_TRAILER,        /* timestamp of last modification of the file */
+    SENDING_ERROR           /* "-ERR\r\n", the connection is closed afterwards */
+};
+
+struct connection {
+    struct shard* shard;
+    int socket;
+    enum connection_state state;
+    uint32_t events;                            /* events currently registered in epoll for the socket */
+
+    time_t last_activity;                       /* connections are kept in a list ordered by last_activity */
+    struct connection *prev, *next;             /* next also links the pool of closed connections */
+
+    char request[MAX_LEN_REQUEST];              /* received bytes not parsed yet (carry-over of pipelined requests) */
+    size_t request_len;
+
+    char out[16];                               /* header, trailer or error message being sent */
+    size_t out_len, out_sent;
+
+    int file_fd;
+    uint32_t file_size, file_sent, timestamp;
+    int use_sendfile;
+};
+
+
+struct shard {
+    int id;
+    int cpu;                                    /* CPU the thread is pinned to, -1 if not pinned */
+    pthread_t thread;
+    int passive_socket;
+    int epoll_fd;
+    int listening;                              /* EPOLLIN of the passive socket is watched */
+    time_t stopped_listening;
+    time_t now;
+    struct connection *oldest, *newest;         /* open connections ordered by last activity */
+    struct connection *pool;                    /* closed connections, reused by the next accepts */
+    char copy_buffer[SERVERBUFLEN];             /* shared by the connections of the shard, data is never kept across events */
+
+    /* written only by the shard, read by the main thread for the reports */
+    uint64_t accepted_connections, open_connections, served_requests, sent_bytes;
+} __attribute__((aligned(64)));
+
+struct shard* shards;
+
+
+/* every counter has a single writer, the atomic store only keeps the reads of the main thread consistent */
+void count(uint64_t* counter, uint64_t n) {
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+
+void touch_connection(struct connection* c) {
+    /* move the connection at the end of the activity list */
+    struct shard* s = c->shard;
+    c->last_activity = s->now;
+    if (c == s->newest) {
+        return;
+    }
+    if (c->prev != NULL || c == s->oldest) {
+        /* unlink */
+        if (c->prev != NULL) c->prev->next = c->next;
+        else s->oldest = c->next;
+        c->next->prev = c->prev;
+    }
+    c->prev = s->newest;
+    c->next = NULL;
+    if (s->newest != NULL) s->newest->next = c;
+    else s->oldest = c;
+    s->newest = c;
+}
+
+
+/* watch or ignore the passive socket, ignored while no descriptor is left for a new connection */
+void watch_listener(struct shard* s, int on) {
+    struct epoll_event ev;
+    ev.events = on ? EPOLLIN : 0;
+    ev.data.ptr = NULL;                                                 /* NULL marks the passive socket */
+    if (epoll_ctl(s->epoll_fd, EPOLL_CTL_MOD, s->passive_socket, &ev) < 0) {
+        printf("error - epoll_ctl() failed for the passive socket\n");
+        exit(-1);
+    }
+    s->listening = on;
+    s->stopped_listening = s->now;
+}
+
+
+void close_connection(struct connection* c) {
+    struct shard* s = c->shard;
+    if (c->prev != NULL) c->prev->next = c->next;
+    else s->oldest = c->next;
+    if (c->next != NULL) c->next->prev = c->prev;
+    else s->newest = c->prev;
+
+    if (c->file_fd >= 0) {
+        close(c->file_fd);
+    }
+    printf("End of service for the client on socket %d - closing the connection.\n", c->socket);
+    Close(c->socket);    /* also removes the socket from the epoll set */
+    count(&s->open_connections, (uint64_t) -1);
+    if (!s->listening) {
+        watch_listener(s, 1);
+    }
+
+    c->next = s->pool;
+    s->pool = c;
+}
+
+
+/* returns -1 if the interest list cannot be updated */
+int watch_connection(struct connection* c, uint32_t events) {
+    if (c->events == events) {
+        return 1;
+    }
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = c;
+    if (epoll_ctl(c->shard->epoll_fd, EPOLL_CTL_MOD, c->socket, &ev) < 0) {
+        return -1;
+    }
+    c->events = events;
+    return 1;
+}
+
+
+/*
+ * extract the first request line from the carry-over buffer.
+ * returns 1 and fills file_name if a complete request was parsed, 0 if more bytes are needed, -1 for an invalid request
+ */
+int parse_request(struct connection* c, char* file_name) {
+    char* end = NULL;
+    for (size_t i = 1; i < c->request_len; ++i) {
+        if (c->request[i - 1] == '\r' && c->request[i] == '\n') {
+            end = &c->request[i - 1];
+            break;
+        }
+    }
+    if (end == NULL) {
+        if (c->request_len == MAX_LEN_REQUEST) {
+            /* request message is longer than the longest valid request */
+            return -1;
+        }
+        return 0;
+    }
+
+    if (end < &c->request[4] || c->request[0] != 'G' || c->request[1] != 'E' || c->request[2] != 'T' || c->request[3] != ' ') {
+        return -1;
+    }
+    size_t name_len = (size_t) (end - &c->request[4]);
+    memcpy(file_name, &c->request[4], name_len);
+    file_name[name_len] = '\0';
+
+    /* keep the bytes of the following requests */
+    size_t consumed = (size_t) (end - c->request) + 2;
+    memmove(c->request, &c->request[consumed], c->request_len - consumed);
+    c->request_len -= consumed;
+    return 1;
+}
+
+
+/* returns -1 if the connection must be closed */
+int start_response(struct connection* c, const char* file_name) {
+    struct stat my_stat;
+
+    printf("requested file on socket %d: %s\n", c->socket, file_name);
+    c->file_fd = open(file_name, O_RDONLY);
+    if (c->file_fd < 0) {
+        printf("file requested on socket %d does not exist on the server\n", c->socket);
+        memcpy(c->out, "-ERR\r\n", 6);
+        c->out_len = 6;
+        c->out_sent = 0;
+        c->state = SENDING_ERROR;
+        return 1;
+    }
+    if (fstat(c->file_fd, &my_stat) == -1) {
+        printf("error while getting timestamp and size for file %s on socket %d\n", file_name, c->socket);
+        return -1;
+    }
+    c->file_size = (uint32_t) my_stat.st_size;
+    c->timestamp = (uint32_t) my_stat.st_mtime;
+    c->file_sent = 0;
+    c->use_sendfile = zero_copy;
+
+    /* send heading of file transfer */
+    uint32_t n_characters_net = htonl(c->file_size);
+    memcpy(c->out, "+OK\r\n", 5);
+    memcpy(&c->out[5], &n_characters_net, 4);
+    c->out_len = 9;
+    c->out_sent = 0;
+    c->state = SENDING_HEADER;
+    return 1;
+}
+
+
+/* returns 1 when the buffer is sent, 0 if the socket is full, -1 on error */
+int send_out(struct connection* c) {
+    while (c->out_sent < c->out_len) {
+        ssize_t new_sent = send(c->socket, &c->out[c->out_sent], c->out_len - c->out_sent, MSG_NOSIGNAL);
+        if (new_sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        c->out_sent += new_sent;
+        count(&c->shard->sent_bytes, (uint64_t) new_sent);
+    }
+    return 1;
+}
+
+
+/* returns 1 when the whole file is sent, 0 if the socket is full, -1 on error */
+int send_file_content(struct connection* c) {
+    while (c->file_sent < c->file_size) {
+        size_t to_send = c->file_size - c->file_sent;
+        ssize_t new_sent;
+
+        if (c->use_sendfile) {
+            off_t offset = c->file_sent;
+            new_sent = sendfile(c->socket, c->file_fd, &offset, to_send < SENDFILE_CHUNK ? to_send : SENDFILE_CHUNK);
+            if (new_sent < 0 && (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+                /* sendfile() not supported for this file, continue with the copy loop */
+                c->use_sendfile = 0;
+                continue;
+            }
+        }
+        else {
+            /* only the bytes accepted by the socket are consumed, the rest is read again on the next event */
+            char* copy_buffer = c->shard->copy_buffer;
+            ssize_t eff_read = pread(c->file_fd, copy_buffer, to_send < SERVERBUFLEN ? to_send : SERVERBUFLEN, c->file_sent);
+            if (eff_read <= 0) {
+                /* error while reading the file on the file system */
+                return -1;
+            }
+            new_sent = send(c->socket, copy_buffer, (size_t) eff_read, MSG_NOSIGNAL);
+        }
+
+        if (new_sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        if (new_sent == 0) {
+            /* file is shorter than expected */
+            return -1;
+        }
+        c->file_sent += new_sent;
+        count(&c->shard->sent_bytes, (uint64_t) new_sent);
+    }
+    return 1;
+}
+
+
+/*
+ * advance the state machine of the connection as far as the socket allows.
+ * returns -1 if the connection must be closed
+ */
+int serve_connection(struct connection* c) {
+    char file_name[MAX_LEN_FILE_NAME + 1];
+    int outcome;
+
+    while (1) {
+        switch (c->state) {
+            case READING_REQUEST:
+                outcome = parse_request(c, file_name);
+                if (outcome < 0) {
+                    printf("Waiting for a request from client but received an invalid request.\n");
+                    return -1;
+                }
+                if (outcome > 0) {
+                    if (start_response(c, file_name) < 0) {
+                        return -1;
+                    }
+                    break;
+                }
+
+                ssize_t new_received = recv(c->socket, &c->request[c->request_len], MAX_LEN_REQUEST - c->request_len, 0);
+                if (new_received < 0) {
+                    if (errno == EINTR) break;
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) return watch_connection(c, EPOLLIN);
+                    return -1;
+                }
+                if (new_received == 0) {
+                    /* end of file requests from Client */
+                    return -1;
+                }
+                c->request_len += new_received;
+                break;
+
+            case SENDING_HEADER:
+            case SENDING_TRAILER:
+            case SENDING_ERROR:
+                outcome = send_out(c);
+                if (outcome < 0) {
+                    return -1;
+                }
+                if (outcome == 0) {
+                    return watch_connection(c, EPOLLOUT);
+                }
+                if (c->state == SENDING_ERROR) {
+                    /* end of service for the Client */
+                    return -1;
+                }
+                if (c->state == SENDING_HEADER) {
+                    c->state = SENDING_FILE;
+                }
+                else {
+                    printf("file transfer on socket %d was successful.\n", c->socket);
+                    count(&c->shard->served_requests, 1);
+                    c->state = READING_REQUEST;
+                }
+                break;
+
+            case SENDING_FILE:
+                outcome = send_file_content(c);
+                if (outcome < 0) {
+                    printf("error occurred while sending the file on socket %d to client\n", c->socket);
+                    return -1;
+                }
+                if (outcome == 0) {
+                    return watch_connection(c, EPOLLOUT);
+                }
+                close(c->file_fd);
+                c->file_fd = -1;
+
+                /* send timestamp of last file modification, in the same byte order used by the other servers */
+                uint32_t timestamp_file_net = htonl(htonl(c->timestamp));
+                memcpy(c->out, &timestamp_file_net, 4);
+                c->out_len = 4;
+                c->out_sent = 0;
+                c->state = SENDING_TRAILER;
+                break;
+        }
+    }
+}
+
+
+void accept_connections(struct shard* sh) {
+    struct sockaddr_in caddr;
+    socklen_t addr_len;
+
+    while (1) {
+        addr_len = sizeof(struct sockaddr_in);
+        int s = accept4(sh->passive_socket, (struct sockaddr *) &caddr, &addr_len, SOCK_NONBLOCK);
+        if (s < 0) {
+            if (errno == EINTR || errno == ECONNABORTED || errno == EPROTO) continue;
+            if (errno == EMFILE || errno == ENFILE) {
+                /*
+                 * the passive socket is level triggered and would wake epoll_wait() again at once: the clients wait
+                 * in the backlog until a connection of the shard is closed, or the next second
+                 */
+                printf("error - accept() failed, no file descriptor left\n");
+                watch_listener(sh, 0);
+                return;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                printf("error - accept() failed\n");
+            }
+            return;
+        }
+
+        struct connection* c = sh->pool;
+        if (c != NULL) {
+            sh->pool = c->next;
+        }
+        else if ((c = malloc(sizeof(struct connection))) == NULL) {
+            printf("cannot allocate the state of a new connection - closing socket %d.\n", s);
+            Close(s);
+            continue;
+        }
+        c->shard = sh;
+        c->socket = s;
+        c->state = READING_REQUEST;
+        c->events = EPOLLIN;
+        c->request_len = 0;
+        c->file_fd = -1;
+        c->prev = c->next = NULL;
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        if (epoll_ctl(sh->epoll_fd, EPOLL_CTL_ADD, s, &ev) < 0) {
+            printf("error - epoll_ctl() failed for socket %d\n", s);
+            Close(s);
+            c->next = sh->pool;
+            sh->pool = c;
+            continue;
+        }
+        touch_connection(c);
+        count(&sh->accepted_connections, 1);
+        count(&sh->open_connections, 1);
+        printf("Accepted new connection on socket %d.\n", s);
+    }
+}
+
+
+int open_passive_socket(uint16_t lport_n, int reuse_port) {
+    struct sockaddr_in 	saddr;	/* server address */
+
+    /* create the socket */
+    int passive_socket = Socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
+
+    if (reuse_port) {
+        /* every shard has its own listening socket on the same port, the kernel balances connections among them */
+        int on = 1;
+        if (setsockopt(passive_socket, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+            printf("error - setsockopt(SO_REUSEPORT) failed\n");
+            exit(-1);
+        }
+    }
+
+    /* bind the socket to any local IP address */
+    bzero(&saddr, sizeof(saddr));
+    saddr.sin_family      = AF_INET;
+    saddr.sin_port        = lport_n;
+    saddr.sin_addr.s_addr = INADDR_ANY;
+    Bind(passive_socket, (struct sockaddr *) &saddr, sizeof(saddr));
+
+    /* listen */
+    int		bk_log = SOMAXCONN;                                     /* listen backlog */
+    Listen(passive_socket, bk_log);
+
+    return passive_socket;
+}
+
+
+void* shard_loop(void* arg) {
+    struct shard* s = arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    if (s->cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(s->cpu, &cpus);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+            printf("cannot pin shard %d to CPU %d.\n", s->id, s->cpu);
+        }
+    }
+
+    s->epoll_fd = epoll_create1(0);
+    if (s->epoll_fd < 0) {
+        printf("error - epoll_create1() failed\n");
+        exit(-1);
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;                                                 /* NULL marks the passive socket */
+    if (epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, s->passive_socket, &ev) < 0) {
+        printf("error - epoll_ctl() failed for the passive socket\n");
+        exit(-1);
+    }
+    s->listening = 1;
+
+    while (1)
+    {
+        int n_events = epoll_wait(s->epoll_fd, events, MAX_EVENTS, 1000);
+        if (n_events < 0 && errno != EINTR) {
+            printf("error - epoll_wait() failed\n");
+            exit(-1);
+        }
+        s->now = time(NULL);
+
+        for (int i = 0; i < n_events; ++i) {
+            struct connection* c = events[i].data.ptr;
+            if (c == NULL) {
+                accept_connections(s);
+                continue;
+            }
+            if (serve_connection(c) < 0) {
+                close_connection(c);
+            }
+            else {
+                touch_connection(c);
+            }
+        }
+
+        /* drop the clients that did not make any progress for CONNECTION_TIMEOUT seconds */
+        while (s->oldest != NULL && s->now - s->oldest->last_activity >= CONNECTION_TIMEOUT) {
+            printf("timeout expired for the client on socket %d.\n", s->oldest->socket);
+            close_connection(s->oldest);
+        }
+        if (!s->listening && s->now != s->stopped_listening) {
+            /* descriptors may have been closed by the other shards */
+            watch_listener(s, 1);
+        }
+    }
+}
+
+
+void report_shards(void) {
+    printf("shard  cpu  accepted connections  open connections  served requests  sent bytes\n");
+    for (int i = 0; i < n_shards; ++i) {
+        struct shard* s = &shards[i];
+        printf("%5d  %3d  %20" PRIu64 "  %16" PRIu64 "  %15" PRIu64 "  %10" PRIu64 "\n", s->id, s->cpu,
+               __atomic_load_n(&s->accepted_connections, __ATOMIC_RELAXED),
+               __atomic_load_n(&s->open_connections, __ATOMIC_RELAXED),
+               __atomic_load_n(&s->served_requests, __ATOMIC_RELAXED),
+               __atomic_load_n(&s->sent_bytes, __ATOMIC_RELAXED));
+    }
+    fflush(stdout);
+}
+
+
+int main(int argc, char *argv[])
+{
+    uint16_t 	lport_n, lport_h;	/* port used by server (net/host ord.) */
+
+    program_name = argv[0];
+
+    int option;
+    while ((option = getopt(argc, argv, "ct:")) != -1) {
+        switch (option) {
+            case 'c':
+                zero_copy = 0;
+                break;
+            case 't':
+                n_shards = atoi(optarg);
+                if (n_shards > 0) {
+                    break;
+                }
+                /* fall through */
+            default:
+                printf("Usage: %s [-c] [-t <number of threads>] <port number>\n", program_name);
+                exit(1);
+        }
+    }
+
+    if (argc - optind != 1) {
+        printf("Usage: %s [-c] [-t <number of threads>] <port number>\n", program_name);
+        exit(1);
+    }
+
+    unsigned long tmp_port = strtoul(argv[optind], NULL, 0);
+    if ((tmp_port == ULONG_MAX) || (tmp_port < 1024) || (tmp_port > 65535)) {
+        printf("Enter a valid port number - port numbers must be between 1024 and 65535\n");
+        exit(1);
+    }
+    lport_h = (uint16_t) tmp_port;
+    lport_n = htons(lport_h);
+
+    /* a write on a socket closed by the client must not terminate the server: sendfile() cannot take MSG_NOSIGNAL */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* one descriptor per connection: raise the limit on open files as far as allowed */
+    struct rlimit files_limit;
+    if (getrlimit(RLIMIT_NOFILE, &files_limit) == 0) {
+        files_limit.rlim_cur = files_limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files_limit);
+    }
+
+    if (n_shards == 0) {
+        /* single event loop in the main thread */
+        struct shard* s = aligned_alloc(64, sizeof(struct shard));
+        if (s == NULL) {
+            printf("cannot allocate the event loop.\n");
+            exit(-1);
+        }
+        memset(s, 0, sizeof(struct shard));
+        s->cpu = -1;
+        s->passive_socket = open_passive_socket(lport_n, 0);
+        printf("Waiting for first Client connection...\n");
+        shard_loop(s);
+    }
+
+    /* the CPUs the process may run on, shards are pinned to them in order */
+    cpu_set_t allowed;
+    int allowed_cpus[CPU_SETSIZE];
+    int n_allowed = 0;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &allowed)) {
+                allowed_cpus[n_allowed++] = cpu;
+            }
+        }
+    }
+
+    shards = aligned_alloc(64, n_shards * sizeof(struct shard));
+    if (shards == NULL) {
+        printf("cannot allocate the shards.\n");
+        exit(-1);
+    }
+    memset(shards, 0, n_shards * sizeof(struct shard));
+
+    /* only the main thread handles the signals: SIGUSR1 prints the counters, SIGINT and SIGTERM print them and terminate */
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    for (int i = 0; i < n_shards; ++i) {
+        shards[i].id = i;
+        shards[i].cpu = n_allowed > 0 ? allowed_cpus[i % n_allowed] : -1;
+        shards[i].passive_socket = open_passive_socket(lport_n, 1);
+        if (pthread_create(&shards[i].thread, NULL, shard_loop, &shards[i]) != 0) {
+            printf("cannot create the thread of shard %d.\n", i);
+            exit(-1);
+        }
+    }
+    printf("Waiting for first Client connection on %d shards (kill -USR1 %d prints the counters)...\n", n_shards, getpid());
+
+    while (1) {
+        int sig;
+        if (sigwait(&signals, &sig) != 0) {
+            continue;
+        }
+        report_shards();
+        if (sig != SIGUSR1) {
+            exit(0);
+        }
+    }
+}
@@ -0,0 +1,292 @@
+
+/*
+ *  Library of functions for sockets
+ *
+ * 	File name: protocol.c
+ * 	Developer: Victor Cappa
+ * 	Date of last modification: 10/05/2019
+ *
+ */
+
+#include    <stdlib.h>
+#include    <string.h>
+#include    <inttypes.h>
+#include    <sys/stat.h>
+#include    <errno.h>
+#include    <syslog.h>
+#include    <unistd.h>
+#include    <stdio.h>
+#include    <bits/types/FILE.h>
+#include    <sys/socket.h>
+#include    <sys/select.h>
+#include    <poll.h>
+#include    <time.h>
+#include    <sys/wait.h>
+#ifdef __linux__
+#include    <sys/sendfile.h>
+#endif
+#include    <netinet/in.h>
+#include    <arpa/inet.h>
+#include    <netdb.h>
+#include    "protocol.h"
+
+
+int Select(int max_fd, fd_set *read_set, fd_set *write_set, fd_set *except_set, struct timeval *timeout) {
+    int n;
+    again:
+    if ( (n = select (max_fd, read_set, write_set, except_set, timeout)) < 0)
+    {
+        if (errno == EINTR)
+            goto again;
+        else {
+            printf("error - select() failed");
+            return -1;
+        }
+    }
+    return n;
+}
+
+int Socket (int family, int type, int protocol) {
+    int n;
+    if ( (n = socket(family,type,protocol)) < 0){
+        printf("error - socket() failed\n");
+        exit(-1);
+    }
+    return n;
+}
+
+
+void Bind (int sockfd, const struct sockaddr *myaddr,  socklen_t myaddrlen) {
+    if ( bind(sockfd, myaddr, myaddrlen) != 0){
+        printf("error - bind() failed\n");
+        exit(-1);
+    }
+}
+
+
+void Listen (int sockfd, int backlog) {
+    char *ptr;
+    if ( (ptr = getenv("LISTENQ")) != NULL)
+        backlog = atoi(ptr);
+    if ( listen(sockfd,backlog) < 0 ) {
+        printf("error - listen() failed\n");
+        exit(-1);
+    }
+}
+
+
+int Accept (int listen_sockfd, struct sockaddr *cliaddr, socklen_t *addrlenp) {
+    int n;
+    again:
+    if ( (n = accept(listen_sockfd, cliaddr, addrlenp)) < 0)
+    {
+        if (errno == EINTR || errno == EPROTO || errno == ECONNABORTED || errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+            goto again;
+        else {
+            printf("error - accept() failed\n");
+            return -1;
+        }
+    }
+    return n;
+}
+
+
+void Connect (int sockfd, const struct sockaddr *srvaddr, socklen_t addrlen) {
+    if (connect(sockfd, srvaddr, addrlen) != 0) {
+        printf("error - connect() failed\n");
+        exit(-1);
+    }
+}
+
+
+void Close (int fd) {
+    if (close(fd) != 0) {
+        printf("error - close() failed for socket %d\n", fd);
+    }
+}
+
+
+/*
+ * deadline of an operation on a socket: SOCKET_TIMEOUT seconds from now
+ */
+void set_deadline(struct timespec* deadline) {
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += SOCKET_TIMEOUT;
+}
+
+
+/*
+ * waits until the socket is ready for events (POLLIN or POLLOUT) or the deadline expires.
+ * returns 1 if the socket is ready, 0 if the deadline expired, -1 on error
+ */
+int wait_socket(int connected_socket, short events, const struct timespec* deadline) {
+    struct pollfd socket_poll;
+    struct timespec now;
+    int outcome;
+
+    socket_poll.fd = connected_socket;
+    socket_poll.events = events;
+    while (1) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long remaining_ms = (deadline->tv_sec - now.tv_sec) * 1000 + (deadline->tv_nsec - now.tv_nsec) / 1000000;
+        if (remaining_ms <= 0) {
+            return 0;
+        }
+
+        outcome = poll(&socket_poll, 1, (int) remaining_ms);
+        if (outcome < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (outcome == 0) {
+            return 0;
+        }
+        /* errors and hang-ups are reported by the next recv()/send() */
+        return 1;
+    }
+}
+
+
+/*
+ * n_elements must be lower than maximum size of buffer, the whole operation must complete within SOCKET_TIMEOUT seconds.
+ * the socket is polled only when no data is available.
+*/
+int recv_n (int connected_socket, char* buffer, size_t n_elements) {
+    char* buf_cursor = buffer;
+    ssize_t new_received;
+    size_t to_read = n_elements;
+
+    struct timespec deadline;
+    int outcome = 0;
+
+    int must_wait = 0;      /* the socket has been drained, poll() it before the next recv() */
+
+    set_deadline(&deadline);
+    while (to_read > 0) {
+        if (must_wait) {
+            outcome = wait_socket(connected_socket, POLLIN, &deadline);
+            if (outcome == 0) {
+                /* timeout expired */
+                return -2;
+            }
+            else if (outcome < 0) {
+                /* error happened*/
+                return -1;
+            }
+        }
+
+        new_received = recv(connected_socket, buf_cursor, to_read, MSG_DONTWAIT);
+        if (new_received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            must_wait = 1;
+            continue;
+        }
+        if (new_received <= 0) {
+            return -1;
+        }
+
+        must_wait = ((size_t) new_received < to_read);
+        to_read -= new_received;
+        buf_cursor += new_received;
+    }
+
+    return 1;
+}
+
+
+/*
+ * n_elements must be lower than maximum size of buffer, the whole operation must complete within SOCKET_TIMEOUT seconds
+ */
+int send_n(int connected_socket, const char* buffer, size_t n_elements) {
+    char* buffer_cursor = (char* )buffer;
+    ssize_t new_sent;
+    size_t to_write = n_elements;
+
+    struct timespec deadline;
+    int outcome = 0;
+
+    int must_wait = 0;      /* the socket buffer is full, poll() it before the next send() */
+
+    set_deadline(&deadline);
+    while (to_write > 0) {
+        if (must_wait) {
+            outcome = wait_socket(connected_socket, POLLOUT, &deadline);
+            if (outcome <= 0) {
+                /* error happened or timeout expired */
+                return -1;
+            }
+        }
+
+        new_sent = send(connected_socket, buffer_cursor, to_write, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (new_sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            must_wait = 1;
+            continue;
+        }
+        if (new_sent <= 0) {
+            return -1;
+        }
+
+        must_wait = ((size_t) new_sent < to_write);
+        buffer_cursor += new_sent;
+        to_write -= new_sent;
+    }
+
+    return 1;
+}
+
+
+/*
+ * zero-copy transfer of n_elements bytes of file_fd, starting from *offset, on the connected socket.
+ * *offset is advanced by the number of bytes sent. The socket must be nonblocking: the SOCKET_TIMEOUT
+ * seconds deadline restarts after every chunk that is sent.
+ * returns 1 on success, -1 on error, 0 if sendfile() is not supported for the file: the caller must send
+ * the remaining bytes (starting from *offset) with the copy loop.
+ */
+int sendfile_n(int connected_socket, int file_fd, off_t* offset, size_t n_elements) {
+#ifdef __linux__
+    ssize_t new_sent;
+    size_t to_write = n_elements;
+
+    struct timespec deadline;
+    int outcome = 0;
+
+    int must_wait = 0;      /* the socket buffer is full, poll() it before the next sendfile() */
+
+    set_deadline(&deadline);
+    while (to_write > 0) {
+        if (must_wait) {
+            outcome = wait_socket(connected_socket, POLLOUT, &deadline);
+            if (outcome <= 0) {
+                /* error happened or timeout expired */
+                return -1;
+            }
+        }
+
+        size_t chunk = to_write < SENDFILE_CHUNK ? to_write : SENDFILE_CHUNK;
+        new_sent = sendfile(connected_socket, file_fd, offset, chunk);
+        if (new_sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                must_wait = 1;
+                continue;
+            }
+            if (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP) {
+                /* sendfile() not available for this file, fall back to the copy loop */
+                return 0;
+            }
+            return -1;
+        }
+        if (new_sent == 0) {
+            /* file is shorter than expected */
+            return -1;
+        }
+
+        must_wait = ((size_t) new_sent < chunk);
+        to_write -= new_sent;
+        set_deadline(&deadline);
+    }
+
+    return 1;
+#else
+    return 0;
+#endif
+}
@@ -0,0 +1,221 @@
+/*
+ *  PACK BUILDER
+ *  Distributed Programming I
+ *  Packs the files of a directory for the servers (-p)
+ *
+ * 	File name: main.c
+ *
+ *  Every regular file under the directory is copied into the pack, after the header, then come the records of the
+ *  files sorted by name and the names, relative to the directory as the clients request them. A server given the
+ *  pack answers a request for one of these files with a single read at its offset, without opening it.
+ *  Symbolic links are not followed, and the pack is written to a temporary file renamed over it at the end.
+ *
+ */
+
+#define     _GNU_SOURCE
+#include    <stdlib.h>
+#include    <string.h>
+#include    <errno.h>
+#include    <unistd.h>
+#include    <stdio.h>
+#include    <fcntl.h>
+#include    <limits.h>
+#include    <dirent.h>
+#include    <sys/stat.h>
+#include    "pack_file.h"
+
+#define COPYBUFLEN (128 * 1024)
+#define MAX_LEN_FILE_NAME 200       /* longest name a server accepts, including the terminating '\0' */
+
+/* a file packed, with its name until the records are written */
+struct packed {
+    char* name;
+    struct pack_record record;
+};
+
+char *program_name;
+int pack_fd = -1;
+struct stat pack_stat;              /* of the pack being written, which is not packed itself */
+uint64_t pack_len = sizeof(struct pack_header);
+struct packed* files = NULL;
+size_t n_files = 0;
+size_t files_capacity = 0;
+char buffer[COPYBUFLEN];
+
+
+/* writes len bytes of data at the end of the pack, returns -1 on error */
+int append(const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t written = pwrite(pack_fd, data, len, (off_t) pack_len);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += written;
+        len -= (size_t) written;
+        pack_len += (uint64_t) written;
+    }
+    return 0;
+}
+
+
+/* copies the regular file name of directory_fd to the pack, as path. returns -1 if the pack cannot be written */
+int pack_file(int directory_fd, const char* name, const char* path, const struct stat* file_stat) {
+    int file_fd = openat(directory_fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (file_fd < 0) {
+        printf("cannot open %s - not packed\n", path);
+        return 0;
+    }
+
+    uint64_t offset = pack_len;
+    uint64_t copied = 0;
+    ssize_t eff_read;
+    while (copied < (uint64_t) file_stat->st_size && (eff_read = read(file_fd, buffer, sizeof(buffer))) > 0) {
+        if ((uint64_t) eff_read > (uint64_t) file_stat->st_size - copied) {
+            /* the file grew while being packed, its size is the one of its stat() */
+            eff_read = (ssize_t) ((uint64_t) file_stat->st_size - copied);
+        }
+        if (append(buffer, (size_t) eff_read) < 0) {
+            close(file_fd);
+            return -1;
+        }
+        copied += (uint64_t) eff_read;
+    }
+    close(file_fd);
+    if (copied != (uint64_t) file_stat->st_size) {
+        /* shorter than its stat(): the bytes already copied stay in the pack, unreferenced */
+        printf("cannot read %s - not packed\n", path);
+        return 0;
+    }
+
+    if (n_files == files_capacity) {
+        files_capacity = files_capacity * 2 + 1024;
+        files = realloc(files, files_capacity * sizeof(*files));
+        if (files == NULL) {
+            printf("out of memory\n");
+            exit(1);
+        }
+    }
+    struct packed* file = &files[n_files++];
+    memset(file, 0, sizeof(*file));
+    file->name = strdup(path);
+    file->record.offset = offset;
+    file->record.size = (uint64_t) file_stat->st_size;
+    file->record.mtime_ns = (uint64_t) file_stat->st_mtim.tv_sec * 1000000000 + (uint64_t) file_stat->st_mtim.tv_nsec;
+    return 0;
+}
+
+
+/* packs the files under directory_fd, whose path relative to the packed directory is prefix. returns -1 on error */
+int pack_directory(int directory_fd, const char* prefix) {
+    DIR* stream = fdopendir(directory_fd);
+    if (stream == NULL) {
+        close(directory_fd);
+        return 0;
+    }
+
+    struct dirent* dir_entry;
+    char path[MAX_LEN_FILE_NAME];
+    int outcome = 0;
+    while (outcome == 0 && (dir_entry = readdir(stream)) != NULL) {
+        if (strcmp(dir_entry->d_name, ".") == 0 || strcmp(dir_entry->d_name, "..") == 0) {
+            continue;
+        }
+        if (snprintf(path, sizeof(path), "%s%s%s", prefix, prefix[0] != '\0' ? "/" : "", dir_entry->d_name) >= (int) sizeof(path)) {
+            printf("%s%s%s: name too long for the servers - not packed\n", prefix, prefix[0] != '\0' ? "/" : "", dir_entry->d_name);
+            continue;
+        }
+
+        struct stat file_stat;
+        if (fstatat(dirfd(stream), dir_entry->d_name, &file_stat, AT_SYMLINK_NOFOLLOW) != 0) {
+            continue;
+        }
+        if (S_ISDIR(file_stat.st_mode)) {
+            int subdirectory_fd = openat(dirfd(stream), dir_entry->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (subdirectory_fd >= 0) {
+                outcome = pack_directory(subdirectory_fd, path);
+            }
+        }
+        else if (S_ISREG(file_stat.st_mode) && (file_stat.st_dev != pack_stat.st_dev || file_stat.st_ino != pack_stat.st_ino)) {
+            outcome = pack_file(dirfd(stream), dir_entry->d_name, path, &file_stat);
+        }
+    }
+    closedir(stream);
+    return outcome;
+}
+
+
+int compare_files(const void* a, const void* b) {
+    return strcmp(((const struct packed*) a)->name, ((const struct packed*) b)->name);
+}
+
+
+/* writes the records and the names after the contents, then the header. returns -1 on error */
+int write_index(void) {
+    qsort(files, n_files, sizeof(*files), compare_files);
+
+    struct pack_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PACK_MAGIC, sizeof(header.magic));
+    header.version = PACK_VERSION;
+    header.record_len = sizeof(struct pack_record);
+    header.n_files = n_files;
+    header.records_offset = pack_len;
+    header.names_offset = pack_len + n_files * sizeof(struct pack_record);
+
+    uint64_t name = 0;
+    for (size_t a = 0; a < n_files; a++) {
+        files[a].record.name = (uint32_t) name;
+        name += strlen(files[a].name) + 1;
+        if (name > UINT32_MAX || append((const char*) &files[a].record, sizeof(files[a].record)) < 0) {
+            return -1;
+        }
+    }
+    for (size_t a = 0; a < n_files; a++) {
+        if (append(files[a].name, strlen(files[a].name) + 1) < 0) {
+            return -1;
+        }
+    }
+    if (n_files == 0 && append("", 1) < 0) {
+        /* the names are never empty */
+        return -1;
+    }
+    header.names_len = pack_len - header.names_offset;
+    return pwrite(pack_fd, &header, sizeof(header), 0) == (ssize_t) sizeof(header) ? 0 : -1;
+}
+
+
+int main(int argc, char *argv[]) {
+    program_name = argv[0];
+    if (argc != 3) {
+        printf("Usage: %s <pack> <directory>\n", program_name);
+        exit(1);
+    }
+    const char* pack_path = argv[1];
+    const char* directory = argv[2];
+
+    int directory_fd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (directory_fd < 0) {
+        printf("cannot open the directory %s\n", directory);
+        exit(1);
+    }
+
+    char temporary[PATH_MAX];
+    snprintf(temporary, sizeof(temporary), "%s.%d", pack_path, getpid());
+    pack_fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (pack_fd < 0 || fstat(pack_fd, &pack_stat) != 0) {
+        printf("cannot create the pack %s\n", temporary);
+        exit(1);
+    }
+
+    if (pack_directory(directory_fd, "") < 0 || write_index() < 0 || fsync(pack_fd) != 0 || close(pack_fd) != 0 ||
+        rename(temporary, pack_path) != 0) {
+        printf("cannot write the pack %s\n", pack_path);
+        unlink(temporary);
+        exit(1);
+    }
+    printf("packed %zu files of %s, %llu bytes, in %s\n", n_files, directory, (unsigned long long) pack_len, pack_path);
+    return 0;
+}
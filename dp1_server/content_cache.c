@@ -0,0 +1,220 @@
+/*
+ *  In-memory cache of the content of small files
+ *
+ *  Entries are ready-made legacy GET responses ("+OK\r\n", size, content, timestamp) plus the v2 heading, so a hit
+ *  is a single send() with no file system access. The memory is bounded by a byte budget with LRU eviction.
+ *  Changed files are dropped through the inotify events read by the file cache, files in subdirectories by
+ *  comparing their stat() again after FILE_CACHE_TTL seconds.
+ *
+ */
+
+#define     _GNU_SOURCE
+#include    <stdlib.h>
+#include    <string.h>
+#include    <stdio.h>
+#include    <inttypes.h>
+#include    <unistd.h>
+#include    <endian.h>
+#include    <arpa/inet.h>
+#include    "content_cache.h"
+#include    "file_cache.h"
+
+struct content_cache_stats content_stats;
+static struct cached_content* buckets[CONTENT_CACHE_BUCKETS];
+static struct cached_content* newest = NULL;
+static struct cached_content* oldest = NULL;
+
+
+static uint32_t hash_name(const char* name) {
+    /* FNV-1a */
+    uint32_t hash = 2166136261u;
+    for (const unsigned char* c = (const unsigned char*) name; *c != '\0'; ++c) {
+        hash = (hash ^ *c) * 16777619u;
+    }
+    return hash;
+}
+
+
+static void unlink_lru(struct cached_content* content) {
+    if (content->newer != NULL) {
+        content->newer->older = content->older;
+    }
+    else {
+        newest = content->older;
+    }
+    if (content->older != NULL) {
+        content->older->newer = content->newer;
+    }
+    else {
+        oldest = content->newer;
+    }
+}
+
+
+static void push_lru(struct cached_content* content) {
+    content->older = newest;
+    content->newer = NULL;
+    if (newest != NULL) {
+        newest->newer = content;
+    }
+    newest = content;
+    if (oldest == NULL) {
+        oldest = content;
+    }
+}
+
+
+static void remove_content(struct cached_content* content) {
+    struct cached_content** link = &buckets[content->hash % CONTENT_CACHE_BUCKETS];
+    while (*link != content) {
+        link = &(*link)->next_in_bucket;
+    }
+    *link = content->next_in_bucket;
+    unlink_lru(content);
+
+    content_stats.entries--;
+    content_stats.bytes -= content->response_len;
+    free(content->name);
+    free(content);
+}
+
+
+static struct cached_content* find_content(const char* file_name, uint32_t hash) {
+    for (struct cached_content* content = buckets[hash % CONTENT_CACHE_BUCKETS]; content != NULL; content = content->next_in_bucket) {
+        if (content->hash == hash && strcmp(content->name, file_name) == 0) {
+            return content;
+        }
+    }
+    return NULL;
+}
+
+
+void content_cache_init(size_t budget) {
+    content_cache_drop_all();
+    memset(&content_stats, 0, sizeof(content_stats));
+    content_stats.budget = budget;
+}
+
+
+void content_cache_drop(const char* file_name) {
+    struct cached_content* content = find_content(file_name, hash_name(file_name));
+    if (content != NULL) {
+        content_stats.invalidations++;
+        remove_content(content);
+    }
+}
+
+
+void content_cache_drop_all(void) {
+    while (oldest != NULL) {
+        content_stats.invalidations++;
+        remove_content(oldest);
+    }
+}
+
+
+/* returns the prepared response for file_name, NULL if it is not cached or has changed */
+struct cached_content* content_cache_get(const char* file_name) {
+    if (content_stats.budget == 0) {
+        return NULL;
+    }
+    file_cache_poll_events();
+
+    uint32_t hash = hash_name(file_name);
+    struct cached_content* content = find_content(file_name, hash);
+    if (content == NULL) {
+        content_stats.misses++;
+        return NULL;
+    }
+
+    if (!file_cache_watches(file_name)) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec - content->checked >= FILE_CACHE_TTL) {
+            if (file_cache_changed(file_name, &content->file_stat)) {
+                content_stats.invalidations++;
+                content_stats.misses++;
+                remove_content(content);
+                return NULL;
+            }
+            content->checked = now.tv_sec;
+        }
+    }
+
+    content_stats.hits++;
+    unlink_lru(content);
+    push_lru(content);
+    return content;
+}
+
+
+/*
+ * reads the file open in file_fd into a new entry, evicting the least recently used ones to stay within the budget.
+ * returns NULL if the file is too large to be cached or cannot be read.
+ */
+struct cached_content* content_cache_load(const char* file_name, int file_fd, const struct stat* file_stat) {
+    uint64_t file_size = (uint64_t) file_stat->st_size;
+    size_t response_len = CONTENT_HEAD_LEN + file_size + 4;
+    if (file_size > CONTENT_CACHE_MAX_FILE || response_len > content_stats.budget) {
+        return NULL;
+    }
+
+    struct cached_content* content = malloc(sizeof(*content) + response_len);
+    if (content == NULL || (content->name = strdup(file_name)) == NULL) {
+        free(content);
+        return NULL;
+    }
+    char* body = &content->response[CONTENT_HEAD_LEN];
+    size_t loaded = 0;
+    while (loaded < file_size) {
+        ssize_t eff_read = pread(file_fd, &body[loaded], file_size - loaded, (off_t) loaded);
+        if (eff_read <= 0) {
+            free(content->name);
+            free(content);
+            return NULL;
+        }
+        loaded += (size_t) eff_read;
+    }
+
+    /* legacy response, the timestamp in the same byte order used by send_file() */
+    uint32_t file_size_net = htonl((uint32_t) file_size);
+    uint32_t timestamp_net = htonl(htonl((uint32_t) file_stat->st_mtime));
+    memcpy(content->response, "+OK\r\n", 5);
+    memcpy(&content->response[5], &file_size_net, 4);
+    memcpy(&body[file_size], &timestamp_net, 4);
+
+    uint64_t mtime_ns = (uint64_t) file_stat->st_mtim.tv_sec * 1000000000 + (uint64_t) file_stat->st_mtim.tv_nsec;
+    uint64_t heading_net[3] = { htobe64(file_size), htobe64(file_size), htobe64(mtime_ns) };
+    memcpy(content->head_v2, "+OK\r\n", 5);
+    memcpy(&content->head_v2[5], heading_net, 24);
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    content->hash = hash_name(file_name);
+    content->file_stat = *file_stat;
+    content->checked = now.tv_sec;
+    content->file_size = file_size;
+    content->response_len = response_len;
+
+    struct cached_content* previous = find_content(file_name, content->hash);
+    if (previous != NULL) {
+        remove_content(previous);
+    }
+    while (content_stats.bytes + response_len > content_stats.budget) {
+        content_stats.evictions++;
+        remove_content(oldest);
+    }
+    content->next_in_bucket = buckets[content->hash % CONTENT_CACHE_BUCKETS];
+    buckets[content->hash % CONTENT_CACHE_BUCKETS] = content;
+    push_lru(content);
+    content_stats.entries++;
+    content_stats.bytes += response_len;
+    return content;
+}
+
+
+void content_cache_report(void) {
+    printf("content cache: %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64 " evictions, %" PRIu64 " invalidations, %zu files, %zu of %zu bytes\n",
+           content_stats.hits, content_stats.misses, content_stats.evictions, content_stats.invalidations,
+           content_stats.entries, content_stats.bytes, content_stats.budget);
+}
@@ -0,0 +1,48 @@
+#ifndef _CONTENT_CACHE_H
+#define _CONTENT_CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <time.h>
+
+/* content of the hot small files, kept in memory with the responses to GET already prepared */
+#define CONTENT_CACHE_BUDGET (64 << 20)             /* default budget in bytes, -b on the command line */
+#define CONTENT_CACHE_MAX_FILE (256 * 1024)         /* larger files are always sent from the file */
+#define CONTENT_CACHE_BUCKETS 4096
+#define CONTENT_HEAD_LEN 9                          /* "+OK\r\n" and the 32 bit size, legacy format */
+#define CONTENT_HEAD_V2_LEN 29                      /* "+OK\r\n", length, size and time in nanoseconds, v2 format */
+
+struct cached_content {
+    struct cached_content* next_in_bucket;
+    struct cached_content* newer;                   /* LRU list */
+    struct cached_content* older;
+    char* name;
+    uint32_t hash;
+    struct stat file_stat;
+    time_t checked;                                 /* CLOCK_MONOTONIC seconds of the last check of file_stat */
+    uint64_t file_size;
+    char head_v2[CONTENT_HEAD_V2_LEN];
+    size_t response_len;
+    char response[];                                /* legacy response: head, content, timestamp */
+};
+
+struct content_cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t invalidations;
+    size_t entries;
+    size_t bytes;
+    size_t budget;
+};
+
+void content_cache_init(size_t budget);
+struct cached_content* content_cache_get(const char* file_name);
+struct cached_content* content_cache_load(const char* file_name, int file_fd, const struct stat* file_stat);
+void content_cache_drop(const char* file_name);
+void content_cache_drop_all(void);
+void content_cache_report(void);
+extern struct content_cache_stats content_stats;
+
+#endif
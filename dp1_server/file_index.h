@@ -0,0 +1,59 @@
+#ifndef _FILE_INDEX_H
+#define _FILE_INDEX_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* regular files of the served tree, by name relative to the served directory */
+struct index_entry {
+    uint32_t hash;
+    uint32_t name;                  /* offset of the name in the names, INDEX_FREE or INDEX_DELETED */
+    uint64_t inode;
+    uint64_t size;
+    uint64_t mtime_ns;
+};
+
+#define INDEX_FREE 0
+#define INDEX_DELETED 1
+
+/*
+ * snapshot of the index, mapped at startup instead of walking the tree: the header, the directories sorted by name,
+ * the files sorted by directory and then by name (index_entry records, name being an offset in the names), the names.
+ * Written and read on the same machine, in its byte order.
+ */
+#define INDEX_SNAPSHOT_MAGIC "DP1INDEX"
+#define INDEX_SNAPSHOT_VERSION 1
+/* seconds between two snapshots of a changed index */
+#define INDEX_SNAPSHOT_INTERVAL 60
+
+struct index_snapshot_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_len;            /* sizeof(struct index_entry) */
+    uint64_t root_device;           /* the served directory */
+    uint64_t root_inode;
+    uint64_t taken_ns;              /* CLOCK_REALTIME: the directories modified since then are read again */
+    uint64_t n_directories;
+    uint64_t n_files;
+    uint64_t names_len;
+};
+
+struct index_snapshot_directory {
+    uint32_t name;                  /* "" for the served directory */
+    uint32_t n_files;
+    uint64_t first_file;
+    uint64_t inode;
+    uint64_t mtime_ns;
+};
+
+int file_index_build(int root_fd, int inotify_fd, uint32_t inotify_mask, int threads, const char* snapshot_path);
+int file_index_covers(const char* file_name);
+int file_index_lookup(const char* file_name);
+const char* file_index_directory(int wd);
+void file_index_event(const char* file_name, uint32_t mask);
+void file_index_forget_watch(int wd);
+void file_index_rebuild(void);
+void file_index_stop(void);
+void file_index_save(void);
+
+#endif
@@ -10,6 +10,7 @@
  *
  */
 
+#define     _GNU_SOURCE
 #include    <stdlib.h>
 #include    <string.h>
 #include    <inttypes.h>
@@ -22,168 +23,242 @@
 #include    <sys/socket.h>
 #include    <sys/select.h>
 #include    <sys/wait.h>
+#include    <signal.h>
 #include    <netinet/in.h>
 #include    <arpa/inet.h>
 #include    <netdb.h>
 #include    <limits.h>
+#include    <fcntl.h>
+#include    <poll.h>
+#include    <endian.h>
+#include    <sys/uio.h>
 #include    "protocol.h"
+#include    "file_cache.h"
+#include    "content_cache.h"
+#include    "request_parser.h"
+#include    "file_index.h"
+#include    "pack_file.h"
+#include    "send_pipeline.h"
 
 
 #define SERVERBUFLEN		4096
-#define MAX_LEN_FILE_NAME 200
+#define DROP_BEHIND_LEN (128 * 1024 * 1024)    /* ranges at least this long leave the page cache once sent */
 char *program_name;
+int zero_copy = 1;                  /* send files with sendfile(), -c selects the user-space copy loop */
+const char* root_dir = ".";         /* directory served (-d), the names requested cannot leave it */
+int index_threads = 0;              /* threads walking the served tree to index it (-i), 0 looks up every name on the file system */
+const char* packs[PACK_FILES_MAX];  /* packs served before the files of the directory (-p) */
+int n_packs = 0;
+const char* index_snapshot = NULL;  /* file keeping the index between two runs (-s) */
+size_t content_budget = CONTENT_CACHE_BUDGET;  /* bytes of small files kept in memory (-b), 0 disables the content cache */
+int pipeline_buffers = SEND_PIPELINE_BUFFERS;  /* buffers of the copy loop filled by a reader thread (-r), 0 reads and sends in turn */
+size_t pipeline_buffer_len = SEND_PIPELINE_BUFFER_LEN;  /* bytes of each of them (-l), any length: see send_stream() */
+
+
+#define MAX_STREAMS 16              /* MGET responses interleaved on a connection */
+#define FRAME_CHUNK (64 * 1024)     /* content bytes in a FRAME_DATA frame */
+#define FRAME_HEADER_LEN 9
+#define FRAME_HEAD  'H'
+#define FRAME_DATA  'D'
+#define FRAME_ERROR 'E'
+
+/* an MGET response being sent in frames */
+struct stream {
+    uint32_t id;
+    struct cached_file* file;       /* NULL for a free slot */
+    uint64_t file_size;
+    uint64_t sent;
+};
 
 
-int get_request(int connected_socket, char* buffer, char* file_name) {
+/*
+ * returns the length of the file name of the next request, see request_parser_next(), -1 on error or end of file
+ * requests from the Client, -2 if there is no complete request and wait is 0.
+ * parser keeps the bytes received from the client and not parsed yet: the requests pipelined by the client after
+ * the current one wait there and are returned, in order, by the next calls. *file_name points into parser and is
+ * valid until the next call.
+ */
+int get_request(int connected_socket, struct request_parser* parser, char** file_name, struct file_range* range, int wait) {
 
     ssize_t new_received;
-    size_t to_read = SERVERBUFLEN;
-    char* buf_cursor = buffer;
 
-    struct timeval timer;
-    fd_set socket_reading;
+    struct timespec deadline;
     int outcome = 0;
+    int must_wait = 0;
 
-    /*  get the request from the client */
-    while (1)
+    /*  get the request from the client, waiting for it at most SOCKET_TIMEOUT seconds */
+    set_deadline(&deadline);
+    while ((outcome = request_parser_next(parser, range, file_name)) == -2)
     {
-        FD_ZERO(&socket_reading);
-        FD_SET(connected_socket, &socket_reading);
-        timer.tv_sec = 15;
-        timer.tv_usec = 0;
-        outcome = Select(FD_SETSIZE, &socket_reading, NULL, NULL, &timer);
-        if (outcome <= 0) {
-            /* timeout expired or error happened */
+        size_t to_read;
+        char* space = request_parser_space(parser, &to_read);
+        if (to_read == 0) {
+            /* request message is longer than the buffer and thus is illegal */
+            printf("Waiting for a request from client but received an invalid request.\n");
             return -1;
         }
-        else {
-            new_received = recv(connected_socket, buf_cursor, to_read, 0);
-            if (new_received <= 0) {
-                return -1;
-            }
 
-            if(buf_cursor[new_received - 2] == '\r' && buf_cursor[new_received - 1] == '\n') {
-                /* termination of reading request is reached */
-                break;
+        if (must_wait) {
+            if (!wait) {
+                return -2;
             }
-
-            /* continue with the reading loop */
-            buf_cursor += new_received;
-            to_read -= new_received;
-
-            if(to_read <= 0) {
-                /* request message is longer than SERVERBUFLEN bytes and thus is illegal */
-                printf("Waiting for a request from client but received an invalid request.\n");
+            outcome = wait_socket(connected_socket, POLLIN, &deadline);
+            if (outcome <= 0) {
+                /* timeout expired or error happened */
                 return -1;
             }
         }
 
-    }
-
-    /*  extrapolate the file name  */
-    int count = 0;
-    if(buffer[0] == 'G' && buffer[1] == 'E' && buffer[2] == 'T' && buffer[3] == ' ') {
-        for(int i = 4; buffer[i] != '\r'; ++i) {
-            file_name[count++]  = buffer[i];
-
-            if (count == (MAX_LEN_FILE_NAME - 1))
-                break;
+        new_received = recv(connected_socket, space, to_read, MSG_DONTWAIT);
+        if (new_received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            must_wait = 1;
+            continue;
+        }
+        if (new_received <= 0) {
+            return -1;
         }
 
-        file_name[count] = '\0';
-        return count;
+        /* continue with the parsing loop, poll() first if the socket has been drained */
+        request_parser_received(parser, (size_t) new_received);
+        must_wait = ((size_t) new_received < to_read);
     }
-    else {
+
+    if (outcome < 0) {
         /* invalid request to server */
         printf("Waiting for a request from client but received an invalid request.\n");
         return -1;
     }
+    return outcome;
 }
 
 
-int get_file_timestamp (const char* file_name, uint32_t* timestamp, uint32_t* file_size) {
-    struct stat my_stat;
-    char file_path[100];
-    uint32_t tmp = 0, size = 0;
-
-    if (getcwd(file_path, sizeof(file_path)) == NULL) {
-        return -1;
-    }
-    if (strcat(file_path, "/") == NULL) {
-        return -1;
-    }
-    if (strcat(file_path, file_name) == NULL) {
-        return -1;
-    }
-    if(stat(file_path, &my_stat) == -1) {
-        return -1;
-    }
-    tmp = (uint32_t) my_stat.st_mtime;
-    *timestamp = tmp;
-    size = (uint32_t) my_stat.st_size;
-    *file_size = size;
-
-    return 1;
+/* the legacy format has 32 bit size and timestamp in seconds, the v2 format 64 bit size and time in nanoseconds */
+void get_file_timestamp (const struct stat* my_stat, uint32_t* timestamp, uint64_t* file_size, uint64_t* mtime_ns) {
+    *timestamp = (uint32_t) my_stat->st_mtime;
+    *file_size = (uint64_t) my_stat->st_size;
+    *mtime_ns = (uint64_t) my_stat->st_mtim.tv_sec * 1000000000 + (uint64_t) my_stat->st_mtim.tv_nsec;
 }
 
 
-int send_file(int connected_socket, char* buffer, FILE* fd_file, uint32_t timestamp_file, uint32_t file_size) {
-    int outcome = 0;
-
-    /* send heading of file transfer */
-    uint32_t n_characters_net = htonl(file_size);
-    char* cursor = (char* ) &n_characters_net;
-    buffer[0] = '+';
-    buffer[1] = 'O';
-    buffer[2] = 'K';
-    buffer[3] = '\r';
-    buffer[4] = '\n';
-    memcpy(&buffer[5], &cursor[0], 4);
-    outcome = send_n(connected_socket, buffer, 9);
-    if(outcome <= 0) {
-        return -1;
-    }
-
-    int iterations = (int) (file_size / SERVERBUFLEN);
-    for (int a = 0; a < iterations; ++a) {
-        size_t eff_read = fread(buffer, sizeof(char), SERVERBUFLEN, fd_file);
-        if (eff_read != SERVERBUFLEN) {
-            /* error while reading  the file on the file system */
-            return -1;
-        }
-        outcome = send_n(connected_socket, buffer, SERVERBUFLEN);
-        if (outcome <= 0) {
+/* sends the bytes of range of file_fd, without copying them in user space when sendfile() is available */
+int send_range(int connected_socket, char* buffer, int file_fd, const struct file_range* range) {
+    off_t offset = (off_t) range->offset;
+    if (zero_copy) {
+        int outcome = sendfile_n(connected_socket, file_fd, &offset, range->length);
+        if (outcome < 0) {
             /* error while sending the file */
             return -1;
         }
+        /* outcome == 0: sendfile() not supported, send the rest of the range with the copy loop */
+    }
+    uint64_t to_copy = range->offset + range->length - (uint64_t) offset;
+    int outcome = send_pipeline_send(connected_socket, file_fd, (uint64_t) offset, to_copy);
+    if (outcome != 0) {
+        return outcome;
     }
-    if ((file_size % SERVERBUFLEN) != 0) {
-        size_t eff_read = fread(buffer, sizeof(char), file_size % SERVERBUFLEN, fd_file);
-        if (eff_read != (file_size % SERVERBUFLEN)) {
+    /* pread(): the file descriptor is shared by all the responses with the same file */
+    while (to_copy > 0) {
+        size_t len = to_copy < SERVERBUFLEN ? (size_t) to_copy : SERVERBUFLEN;
+        ssize_t eff_read = pread(file_fd, buffer, len, offset);
+        if (eff_read != (ssize_t) len) {
             /* error while reading  the file on the file system */
             return -1;
         }
-        outcome = send_n(connected_socket, buffer, file_size % SERVERBUFLEN);
-        if (outcome <= 0) {
+        if (send_n(connected_socket, buffer, len) <= 0) {
             /* error while sending the file */
             return -1;
         }
+        offset += (off_t) len;
+        to_copy -= len;
     }
+    return 1;
+}
+
 
-    /* send timestamp of last file modification */
+/*
+ * sends the bytes of range, already clamped to the file size.
+ * legacy format: "+OK\r\n", the number of bytes, for GETR and RESM the size of the whole file, for RESM the
+ * timestamp, then the bytes and the timestamp, 32 bits each.
+ * v2 format: "+OK\r\n", the number of bytes, the size of the whole file and the modification time in nanoseconds,
+ * 64 bits each in network byte order, then the bytes. Everything is known before the content.
+ * the pieces leave together: a single sendmsg() for a small range, a corked socket around sendfile() otherwise,
+ * so that Nagle's algorithm never holds back the content waiting for the ACK of the heading.
+ */
+int send_file(int connected_socket, char* buffer, int file_fd, uint32_t timestamp_file, uint64_t mtime_ns, uint64_t file_size, const struct file_range* range, int version) {
+    /* heading of file transfer */
+    char heading[CONTENT_HEAD_V2_LEN];
+    uint32_t n_characters_net = htonl((uint32_t) range->length);
+    memcpy(heading, "+OK\r\n", 5);
+    memcpy(&heading[5], &n_characters_net, 4);
+    size_t heading_len = 9;
+    if (version == 2) {
+        uint64_t heading_net[3] = { htobe64(range->length), htobe64(file_size), htobe64(mtime_ns) };
+        memcpy(&heading[5], heading_net, 24);
+        heading_len = 29;
+    }
+    else if (range->type != REQUEST_GET) {
+        uint32_t file_size_net = htonl((uint32_t) file_size);
+        memcpy(&heading[9], &file_size_net, 4);
+        heading_len = 13;
+    }
+    if (version == 1 && range->type == REQUEST_RESUME) {
+        /* the client records it before the content, to resume the transfer if it gets interrupted */
+        uint32_t timestamp_file_net = htonl(timestamp_file);
+        memcpy(&heading[13], &timestamp_file_net, 4);
+        heading_len = 17;
+    }
+
+    /* timestamp of last file modification after the content, the v2 heading already has the modification time */
     uint32_t timestamp_file_net = htonl(timestamp_file);
-    cursor = (char* ) &timestamp_file_net;
-    memcpy(&buffer[0], &cursor[0], 4);
-    outcome = send_n(connected_socket, buffer, 4);
-    if (outcome <= 0) {
-        /* error while sending the file */
+    size_t trailer_len = version == 2 ? 0 : 4;
+
+    if (range->length <= SERVERBUFLEN) {
+        /* small range: copied next to the heading and sent with a single call */
+        ssize_t eff_read = range->length == 0 ? 0 : pread(file_fd, buffer, range->length, (off_t) range->offset);
+        if (eff_read != (ssize_t) range->length) {
+            /* error while reading  the file on the file system */
+            return -1;
+        }
+        struct iovec response[3] = {
+            { heading, heading_len }, { buffer, range->length }, { &timestamp_file_net, trailer_len }
+        };
+        return sendv_n(connected_socket, response, 3) <= 0 ? -1 : 1;
+    }
+
+    set_cork(connected_socket, 1);
+    if (send_n(connected_socket, heading, heading_len) <= 0 || send_range(connected_socket, buffer, file_fd, range) < 0 ||
+        (trailer_len > 0 && send_n(connected_socket, (const char* ) &timestamp_file_net, trailer_len) <= 0)) {
+        /* left corked: after a failed send the caller closes the connection, and the partial frame is not flushed */
         return -1;
     }
+    set_cork(connected_socket, 0);
+
+    if (range->length >= DROP_BEHIND_LEN) {
+        /*
+         * a very large file streamed once would evict the hot files from the page cache: its pages go, apart from
+         * those still in the socket buffer
+         */
+        posix_fadvise(file_fd, (off_t) range->offset, (off_t) range->length, POSIX_FADV_DONTNEED);
+    }
 
     return 1;	/* success in sending the file */
 }
 
 
+/* sends the response to a GET prepared by the content cache, returned -1 in case of error */
+int send_content(int connected_socket, const struct cached_content* content, int version) {
+    if (version == 2) {
+        struct iovec response[2] = {
+            { (void* ) content->head_v2, CONTENT_HEAD_V2_LEN }, { (void* ) &content->response[CONTENT_HEAD_LEN], content->file_size }
+        };
+        return sendv_n(connected_socket, response, 2) <= 0 ? -1 : 1;
+    }
+
+    /* legacy format: heading, content and timestamp in a single send() */
+    return send_n(connected_socket, content->response, content->response_len) <= 0 ? -1 : 1;
+}
+
+
 /* returned -1 in case of error */
 int send_error_message(int connected_socket) {
     const char error_message[] = "-ERR\r\n";
@@ -194,26 +269,253 @@ int send_error_message(int connected_socket) {
 }
 
 
+/* the file of a RESM request is not the one of the interrupted transfer anymore, returned -1 in case of error */
+int send_changed_message(int connected_socket) {
+    const char changed_message[] = "-CHG\r\n";
+    size_t changed_message_len = 6;
+
+    return send_n(connected_socket, changed_message, changed_message_len);
+}
+
+
+/* sends a frame: request ID, frame type and payload length, then the payload_len bytes at &frame[FRAME_HEADER_LEN] */
+int send_frame(int connected_socket, char* frame, uint32_t id, char type, uint32_t payload_len) {
+    uint32_t id_net = htonl(id);
+    uint32_t payload_len_net = htonl(payload_len);
+
+    memcpy(&frame[0], &id_net, 4);
+    frame[4] = type;
+    memcpy(&frame[5], &payload_len_net, 4);
+    return send_n(connected_socket, frame, FRAME_HEADER_LEN + payload_len);
+}
+
+
+/*
+ * starts the response to "MGET <id> <file name>": a FRAME_HEAD frame with size and modification time in nanoseconds,
+ * 64 bits each, or a FRAME_ERROR frame if the file does not exist. The content follows in FRAME_DATA frames.
+ * returns 1 if a stream has been added, 0 if the response is already complete, -1 on error.
+ */
+int open_stream(int connected_socket, char* frame, struct stream* streams, uint32_t id, const char* file_name) {
+    printf("requested file with ID %" PRIu32 ": %s\n", id, file_name);
+    struct cached_file* file = file_cache_open(file_name);
+    if (file == NULL) {
+        /* the other requests on the connection go on */
+        printf("requested file does not exist on the server\n");
+        return send_frame(connected_socket, frame, id, FRAME_ERROR, 0) <= 0 ? -1 : 0;
+    }
+    uint32_t timestamp;
+    uint64_t file_size, mtime_ns;
+    get_file_timestamp(&file->file_stat, &timestamp, &file_size, &mtime_ns);
+
+    uint64_t heading_net[2] = { htobe64(file_size), htobe64(mtime_ns) };
+    memcpy(&frame[FRAME_HEADER_LEN], heading_net, 16);
+    if (send_frame(connected_socket, frame, id, FRAME_HEAD, 16) <= 0) {
+        file_cache_release(file);
+        return -1;
+    }
+    if (file_size == 0) {
+        file_cache_release(file);
+        return 0;
+    }
+
+    for (int a = 0; a < MAX_STREAMS; a++) {
+        if (streams[a].file == NULL) {
+            streams[a].id = id;
+            streams[a].file = file;
+            streams[a].file_size = file_size;
+            streams[a].sent = 0;
+            return 1;
+        }
+    }
+    /* the caller never has more than MAX_STREAMS streams open */
+    file_cache_release(file);
+    return -1;
+}
+
+
+/* reads up to len bytes at offset. With nowait the read fails with EAGAIN instead of waiting for the disk */
+ssize_t read_chunk(int file_fd, char* buffer, size_t len, uint64_t offset, int nowait) {
+#ifdef RWF_NOWAIT
+    if (nowait) {
+        struct iovec chunk = { buffer, len };
+        ssize_t outcome = preadv2(file_fd, &chunk, 1, (off_t) offset, RWF_NOWAIT);
+        if (outcome >= 0 || errno != EOPNOTSUPP) {
+            return outcome;
+        }
+        /* no RWF_NOWAIT for this file system, every chunk counts as cached */
+    }
+#else
+    (void) nowait;
+#endif
+    return pread(file_fd, buffer, len, (off_t) offset);
+}
+
+
+/*
+ * sends the next chunk of one of the streams, taking them in round robin. Chunks already in the page cache go first:
+ * a stream whose next chunk would wait for the disk is skipped, after asking the kernel to read it ahead, and a
+ * blocking read happens only when all the streams are waiting for the disk.
+ * returns 1 if a chunk has been sent, 2 if it completed its stream, 0 if there are no streams, -1 on error.
+ */
+int send_next_chunk(int connected_socket, char* frame, struct stream* streams, int* cursor) {
+    for (int nowait = 1; nowait >= 0; nowait--) {
+        for (int a = 0; a < MAX_STREAMS; a++) {
+            struct stream* stream = &streams[(*cursor + a) % MAX_STREAMS];
+            if (stream->file == NULL) {
+                continue;
+            }
+
+            uint64_t left = stream->file_size - stream->sent;
+            size_t len = left < FRAME_CHUNK ? (size_t) left : FRAME_CHUNK;
+            uint64_t offset = stream->file->offset + stream->sent;
+            ssize_t eff_read = read_chunk(stream->file->file_fd, &frame[FRAME_HEADER_LEN], len, offset, nowait);
+            if (eff_read < 0 && errno == EAGAIN) {
+                posix_fadvise(stream->file->file_fd, (off_t) offset, (off_t) len, POSIX_FADV_WILLNEED);
+                continue;
+            }
+            if (eff_read <= 0) {
+                /* error while reading the file, or the file is shorter than announced */
+                return -1;
+            }
+            if (send_frame(connected_socket, frame, stream->id, FRAME_DATA, (uint32_t) eff_read) <= 0) {
+                return -1;
+            }
+
+            *cursor = (*cursor + a + 1) % MAX_STREAMS;
+            stream->sent += (uint64_t) eff_read;
+            if (stream->sent < stream->file_size) {
+                return 1;
+            }
+            if (stream->file_size >= DROP_BEHIND_LEN) {
+                posix_fadvise(stream->file->file_fd, (off_t) stream->file->offset, (off_t) stream->file_size, POSIX_FADV_DONTNEED);
+            }
+            file_cache_release(stream->file);
+            stream->file = NULL;
+            return 2;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * serves MGET requests, starting with the one in file_name and range, interleaving the responses in frames. The
+ * next requests are read while the responses are being sent, without waiting for them. When a request of another
+ * kind arrives, the pending responses are completed and the function returns 1 with that request in file_name and
+ * range, to be served in order. returns -1 on error or end of file requests from the Client.
+ */
+int serve_multiplexed(int connected_socket, struct request_parser* parser, char** file_name, struct file_range* range) {
+    struct stream streams[MAX_STREAMS];
+    char frame[FRAME_HEADER_LEN + FRAME_CHUNK];
+    int active = 0, cursor = 0, outcome = 0;
+
+    for (int a = 0; a < MAX_STREAMS; a++) {
+        streams[a].file = NULL;
+    }
+
+    while (1) {
+        if (range->type == REQUEST_MULTIPLEXED) {
+            outcome = open_stream(connected_socket, frame, streams, range->id, *file_name);
+            if (outcome < 0) {
+                break;
+            }
+            active += outcome;
+        }
+        else if (range->type != REQUEST_NONE) {
+            /* a request answered in order: complete the multiplexed responses before it */
+            while (active > 0 && (outcome = send_next_chunk(connected_socket, frame, streams, &cursor)) > 0) {
+                active -= (outcome == 2);
+            }
+            if (active > 0) {
+                break;
+            }
+            return 1;
+        }
+        range->type = REQUEST_NONE;
+
+        if (active < MAX_STREAMS) {
+            /* wait for the next request only when there is nothing to send */
+            outcome = get_request(connected_socket, parser, file_name, range, active == 0);
+            if (outcome == -1) {
+                break;
+            }
+            if (outcome >= 0) {
+                continue;
+            }
+        }
+        outcome = send_next_chunk(connected_socket, frame, streams, &cursor);
+        if (outcome < 0) {
+            break;
+        }
+        active -= (outcome == 2);
+    }
+
+    for (int a = 0; a < MAX_STREAMS; a++) {
+        if (streams[a].file != NULL) {
+            file_cache_release(streams[a].file);
+        }
+    }
+    return -1;
+}
+
+
 int service_server (int connected_socket) {
     /* serve the client on socket s */
-    char file_name[MAX_LEN_FILE_NAME + 1];
-    file_name[MAX_LEN_FILE_NAME] = '\0';
+    char* file_name = NULL;             /* in parser */
     char buffer[SERVERBUFLEN + 1];
     buffer[SERVERBUFLEN] = '\0';
-    uint32_t file_size = 0;
+    struct request_parser parser;       /* received requests not served yet */
+    request_parser_init(&parser);
+    uint64_t file_size = 0;
     int outcome = 0;
+    int version = 1;                    /* format of the responses, 2 once the client sent "HELO 2" */
 
+    /* all I/O on the socket goes through the deadline-based helpers, which poll() only when the socket is not ready */
+    int flags = fcntl(connected_socket, F_GETFL);
+    if (flags < 0 || fcntl(connected_socket, F_SETFL, flags | O_NONBLOCK) < 0) {
+        return -1;
+    }
+
+    struct file_range range;
+    int pending = 0;                    /* a request already received by serve_multiplexed() */
     while(1) {
         /* receive request from client */
-        int file_name_len = get_request(connected_socket, buffer, file_name);
+        int file_name_len = pending ? 0 : get_request(connected_socket, &parser, &file_name, &range, 1);
+        pending = 0;
         if(file_name_len < 0) {
             /* error while getting the request message or end or file requests from Client */
             return -1;
         }
+        if (range.type == REQUEST_HELLO) {
+            /* the client understands the v2 responses, 64 bit sizes and nanosecond timestamps before the content */
+            version = 2;
+            if (send_n(connected_socket, "+OK\r\n", 5) <= 0) {
+                return -1;
+            }
+            continue;
+        }
+        if (range.type == REQUEST_MULTIPLEXED) {
+            if (serve_multiplexed(connected_socket, &parser, &file_name, &range) < 0) {
+                return -1;
+            }
+            pending = 1;
+            continue;
+        }
 
-        /* check existence of the file in the working directory of the local file system */
         printf("requested file: %s\n", file_name);
-        FILE* my_file = fopen(file_name, "r");
+        struct cached_content* content = range.type == REQUEST_GET ? content_cache_get(file_name) : NULL;
+        if (content != NULL) {
+            /* hot file, its response is already in memory */
+            if (send_content(connected_socket, content, version) < 0) {
+                printf("error occurred while sending file to client\n");
+                return -1;
+            }
+            printf("file transfer was successful.\n");
+            continue;
+        }
+
+        /* check existence of the file in the working directory of the local file system */
+        struct cached_file* my_file = file_cache_open(file_name);
         if(my_file == NULL) {
             /* requested file does not exit on the server, send error message to client, end of service for the Client */
             printf("requested file does not exist on the server\n");
@@ -221,25 +523,59 @@ int service_server (int connected_socket) {
             return -1;
         }
         else {
-            /* file does exist on the server, get last timestamp of file and its size, send file */
+            /* file does exist on the server, get last timestamp of file and its size from the cache, send file */
             uint32_t timestamp;
-            outcome = get_file_timestamp(file_name, &timestamp, &file_size);
-            if (outcome < 0) {
-                /* end of service for the Client */
-                printf("error while getting timestamp and size for file %s\n", file_name);
-                fclose(my_file);
+            uint64_t mtime_ns;
+            get_file_timestamp(&my_file->file_stat, &timestamp, &file_size, &mtime_ns);
+            if (version == 1 && file_size > UINT32_MAX) {
+                /* the legacy format would truncate the size, end of service for the Client */
+                printf("file %s is too large for the legacy response format\n", file_name);
+                send_error_message(connected_socket);
+                file_cache_release(my_file);
                 return -1;
             }
-            /* send request response to client (send file) */
-            outcome = send_file(connected_socket, buffer, my_file, htonl(timestamp), file_size);
+            uint64_t current_timestamp = version == 2 ? mtime_ns : htonl(timestamp);
+            if (range.type == REQUEST_RESUME && range.timestamp != 0 && range.timestamp != current_timestamp) {
+                /* the file changed since the interrupted transfer, the client starts again from the beginning */
+                printf("file %s changed since the interrupted transfer\n", file_name);
+                file_cache_release(my_file);
+                if (send_changed_message(connected_socket) <= 0) {
+                    return -1;
+                }
+                continue;
+            }
+            if (range.offset > file_size) {
+                /* the range starts after the end of the file, end of service for the Client */
+                printf("requested range of file %s starts after its end\n", file_name);
+                send_error_message(connected_socket);
+                file_cache_release(my_file);
+                return -1;
+            }
+            if (range.length > file_size - range.offset) {
+                range.length = file_size - range.offset;
+            }
+
+            /*
+             * send request response to client (send file), small files are kept in memory for the next GET. A packed
+             * file costs a single read already, its range is at its offset in the pack
+             */
+            struct file_range in_file = range;
+            in_file.offset += my_file->offset;
+            if (range.type == REQUEST_GET && content_budget > 0 && !my_file->packed &&
+                (content = content_cache_load(file_name, my_file->file_fd, &my_file->file_stat)) != NULL) {
+                outcome = send_content(connected_socket, content, version);
+            }
+            else {
+                outcome = send_file(connected_socket, buffer, my_file->file_fd, htonl(timestamp), mtime_ns, file_size, &in_file, version);
+            }
             if (outcome < 0) {
                 /* error while sending the file to the Client, end of service for the Client */
                 printf("error occurred while sending file to client\n");
-                fclose(my_file);
+                file_cache_release(my_file);
                 return -1;    /* exit and start listening (accept) for a new client */
             }
 
-            fclose(my_file);
+            file_cache_release(my_file);
         }
 
         printf("file transfer was successful.\n");
@@ -256,12 +592,49 @@ int main(int argc, char *argv[])
 
     program_name = argv[0];
 
-    if (argc != 2) {
-        printf("Usage: %s <port number>\n", program_name);
+    int option;
+    while ((option = getopt(argc, argv, "b:cd:i:l:p:r:s:")) != -1) {
+        switch (option) {
+            case 'b':
+                content_budget = strtoul(optarg, NULL, 0);
+                break;
+            case 'c':
+                zero_copy = 0;
+                break;
+            case 'd':
+                root_dir = optarg;
+                break;
+            case 'i':
+                index_threads = atoi(optarg);
+                break;
+            case 'l':
+                pipeline_buffer_len = strtoul(optarg, NULL, 0);
+                break;
+            case 'p':
+                if (n_packs == PACK_FILES_MAX) {
+                    printf("at most %d packs (-p)\n", PACK_FILES_MAX);
+                    exit(1);
+                }
+                packs[n_packs++] = optarg;
+                break;
+            case 'r':
+                pipeline_buffers = atoi(optarg);
+                break;
+            case 's':
+                index_snapshot = optarg;
+                break;
+            default:
+                printf("Usage: %s [-b <content cache bytes>] [-c] [-d <directory>] [-i <index threads>] [-l <pipeline buffer bytes>] [-p <pack>]... [-r <pipeline buffers>] [-s <index snapshot>] <port number>\n", program_name);
+                exit(1);
+        }
+    }
+
+    if (argc - optind != 1 || index_threads < 0 || pipeline_buffers < 0 || pipeline_buffer_len == 0) {
+        printf("Usage: %s [-b <content cache bytes>] [-c] [-d <directory>] [-i <index threads>] [-l <pipeline buffer bytes>] [-p <pack>]... [-r <pipeline buffers>] [-s <index snapshot>] <port number>\n", program_name);
         exit(1);
     }
 
-    unsigned long tmp_port = strtoul(argv[1], NULL, 0);
+    unsigned long tmp_port = strtoul(argv[optind], NULL, 0);
     if ((tmp_port == ULONG_MAX) || (tmp_port < 1024) || (tmp_port > 65535)) {
         printf("Enter a valid port number - port numbers must be between 1024 and 65535\n");
         exit(1);
@@ -269,6 +642,25 @@ int main(int argc, char *argv[])
     lport_h = (uint16_t) tmp_port;
     lport_n = htons(lport_h);
 
+    /* a write on a socket closed by the client must not terminate the server: sendfile() cannot take MSG_NOSIGNAL */
+    signal(SIGPIPE, SIG_IGN);
+
+    if (index_snapshot != NULL && index_threads == 0) {
+        printf("the index snapshot (-s) is a snapshot of the index of the served tree (-i)\n");
+        exit(1);
+    }
+    send_pipeline_init(pipeline_buffers, pipeline_buffer_len);
+    if (file_cache_set_root(root_dir) < 0) {
+        printf("cannot open the directory %s\n", root_dir);
+        exit(1);
+    }
+    for (int a = 0; a < n_packs; a++) {
+        if (pack_file_open(packs[a]) < 0) {
+            printf("cannot open the pack %s\n", packs[a]);
+            exit(1);
+        }
+    }
+
     /* create the socket */
     passive_socket = Socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
 
@@ -287,6 +679,12 @@ int main(int argc, char *argv[])
     int	 	s;			                                /* current connected socket (SEQUENTIAL SERVER) */
     socklen_t addr_len = sizeof(struct sockaddr_in);
     printf("Waiting for first Client connection...\n");
+    file_cache_init();
+    if (index_threads > 0) {
+        file_cache_index_tree(index_threads, index_snapshot);
+        file_index_save();
+    }
+    content_cache_init(content_budget);
 
     while (1)
     {
@@ -299,7 +697,9 @@ int main(int argc, char *argv[])
 
         printf("Accepted new connection on socket %d.\n", s);
         service_server(s);
+        content_cache_report();
         printf("End of service for the client on socket %d - closing the connection.\n", s);
         Close(s);
+        file_index_save();
     }
 }
\ No newline at end of file
@@ -0,0 +1,116 @@
+/*
+ *  Files served from packs
+ *
+ *  A pack built by dp1_pack holds many small files: the server opens it once at startup and keeps it open, a request
+ *  for one of its files is a lookup in its records and a single pread() or sendfile() at the offset of the content,
+ *  instead of an open(), a fstat() and a close() of a file of its own. The records and the names are mapped, the
+ *  contents are only read through the descriptor. Packs never change while the server runs: a new pack is served
+ *  by starting the server again.
+ *
+ */
+
+#define     _GNU_SOURCE
+#include    <string.h>
+#include    <stdio.h>
+#include    <unistd.h>
+#include    <fcntl.h>
+#include    <sys/stat.h>
+#include    <sys/mman.h>
+#include    "pack_file.h"
+
+struct pack {
+    int pack_fd;
+    struct pack_header header;
+    const struct pack_record* records;
+    const char* names;
+};
+
+static struct pack packs[PACK_FILES_MAX];
+static int n_packs = 0;
+
+
+/* opens the pack at path for as long as the server runs, before fork(). returns -1 if it is not a pack */
+int pack_file_open(const char* path) {
+    if (n_packs == PACK_FILES_MAX) {
+        return -1;
+    }
+    int pack_fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (pack_fd < 0) {
+        return -1;
+    }
+
+    struct stat pack_stat;
+    struct pack_header header;
+    if (fstat(pack_fd, &pack_stat) != 0 || pread(pack_fd, &header, sizeof(header), 0) != (ssize_t) sizeof(header) ||
+        memcmp(header.magic, PACK_MAGIC, sizeof(header.magic)) != 0 || header.version != PACK_VERSION ||
+        header.record_len != sizeof(struct pack_record) || header.n_files > UINT32_MAX || header.names_len == 0 ||
+        header.names_len > UINT32_MAX || header.records_offset < sizeof(header) ||
+        header.records_offset > (uint64_t) pack_stat.st_size ||
+        header.names_offset != header.records_offset + header.n_files * sizeof(struct pack_record) ||
+        header.names_offset + header.names_len != (uint64_t) pack_stat.st_size) {
+        close(pack_fd);
+        return -1;
+    }
+
+    /* the records and the names, from the page where they start: the contents before them are not mapped */
+    uint64_t page_len = (uint64_t) sysconf(_SC_PAGESIZE);
+    uint64_t map_offset = header.records_offset - header.records_offset % page_len;
+    size_t map_len = (size_t) ((uint64_t) pack_stat.st_size - map_offset);
+    const char* map = mmap(NULL, map_len, PROT_READ, MAP_SHARED, pack_fd, (off_t) map_offset);
+    if (map == MAP_FAILED) {
+        close(pack_fd);
+        return -1;
+    }
+    const char* names = map + (header.names_offset - map_offset);
+    if (names[header.names_len - 1] != '\0') {
+        munmap((void*) map, map_len);
+        close(pack_fd);
+        return -1;
+    }
+
+    struct pack* pack = &packs[n_packs++];
+    pack->pack_fd = pack_fd;
+    pack->records = (const struct pack_record*) (map + (header.records_offset - map_offset));
+    pack->names = names;
+    pack->header = header;
+    printf("serving %llu files from the pack %s\n", (unsigned long long) header.n_files, path);
+    return 0;
+}
+
+
+/*
+ * finds file_name in the packs, the first one opened first. returns 1 with the descriptor of its pack and its record,
+ * 0 if it is in none of them.
+ */
+int pack_file_lookup(const char* file_name, int* pack_fd, const struct pack_record** record) {
+    for (int a = 0; a < n_packs; a++) {
+        const struct pack* pack = &packs[a];
+        size_t low = 0;
+        size_t high = pack->header.n_files;
+        while (low < high) {
+            size_t middle = low + (high - low) / 2;
+            const struct pack_record* candidate = &pack->records[middle];
+            if (candidate->name >= pack->header.names_len) {
+                /* damaged pack */
+                break;
+            }
+            int order = strcmp(file_name, &pack->names[candidate->name]);
+            if (order == 0) {
+                if (candidate->offset < sizeof(struct pack_header) || candidate->offset > pack->header.records_offset ||
+                    candidate->size > pack->header.records_offset - candidate->offset) {
+                    break;
+                }
+                *pack_fd = pack->pack_fd;
+                *record = candidate;
+                return 1;
+            }
+            if (order < 0) {
+                high = middle;
+            }
+            else {
+                low = middle + 1;
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,35 @@
+#ifndef _PACK_FILE_H
+#define _PACK_FILE_H
+
+#include <stdint.h>
+
+/*
+ * many small files in one file built by dp1_pack: the header, the contents of the files one after the other, a record
+ * for each file, sorted by name, and the names. Written and read on the same machine, in its byte order.
+ */
+#define PACK_MAGIC "DP1PACK"
+#define PACK_VERSION 1
+#define PACK_FILES_MAX 16           /* packs served by a server (-p) */
+
+struct pack_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_len;            /* sizeof(struct pack_record) */
+    uint64_t n_files;
+    uint64_t records_offset;        /* the contents end there */
+    uint64_t names_offset;
+    uint64_t names_len;
+};
+
+struct pack_record {
+    uint32_t name;                  /* offset of the name, relative to the served directory, in the names */
+    uint32_t unused;
+    uint64_t offset;                /* of the content in the pack */
+    uint64_t size;
+    uint64_t mtime_ns;              /* of the file packed */
+};
+
+int pack_file_open(const char* path);
+int pack_file_lookup(const char* file_name, int* pack_fd, const struct pack_record** record);
+
+#endif
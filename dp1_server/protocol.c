@@ -19,8 +19,14 @@
 #include    <bits/types/FILE.h>
 #include    <sys/socket.h>
 #include    <sys/select.h>
+#include    <poll.h>
+#include    <time.h>
 #include    <sys/wait.h>
+#ifdef __linux__
+#include    <sys/sendfile.h>
+#endif
 #include    <netinet/in.h>
+#include    <netinet/tcp.h>
 #include    <arpa/inet.h>
 #include    <netdb.h>
 #include    "protocol.h"
@@ -102,37 +108,85 @@ void Close (int fd) {
 
 
 /*
- * n_elements must be lower than maximum size of buffer, timeout for select() is set at 15 seconds
+ * deadline of an operation on a socket: SOCKET_TIMEOUT seconds from now
+ */
+void set_deadline(struct timespec* deadline) {
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += SOCKET_TIMEOUT;
+}
+
+
+/*
+ * waits until the socket is ready for events (POLLIN or POLLOUT) or the deadline expires.
+ * returns 1 if the socket is ready, 0 if the deadline expired, -1 on error
+ */
+int wait_socket(int connected_socket, short events, const struct timespec* deadline) {
+    struct pollfd socket_poll;
+    struct timespec now;
+    int outcome;
+
+    socket_poll.fd = connected_socket;
+    socket_poll.events = events;
+    while (1) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long remaining_ms = (deadline->tv_sec - now.tv_sec) * 1000 + (deadline->tv_nsec - now.tv_nsec) / 1000000;
+        if (remaining_ms <= 0) {
+            return 0;
+        }
+
+        outcome = poll(&socket_poll, 1, (int) remaining_ms);
+        if (outcome < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (outcome == 0) {
+            return 0;
+        }
+        /* errors and hang-ups are reported by the next recv()/send() */
+        return 1;
+    }
+}
+
+
+/*
+ * n_elements must be lower than maximum size of buffer, the whole operation must complete within SOCKET_TIMEOUT seconds.
+ * the socket is polled only when no data is available.
 */
 int recv_n (int connected_socket, char* buffer, size_t n_elements) {
     char* buf_cursor = buffer;
     ssize_t new_received;
     size_t to_read = n_elements;
 
-    struct timeval timer;
-    fd_set socket_reading;
+    struct timespec deadline;
     int outcome = 0;
 
+    int must_wait = 0;      /* the socket has been drained, poll() it before the next recv() */
+
+    set_deadline(&deadline);
     while (to_read > 0) {
-        FD_ZERO(&socket_reading);
-        FD_SET(connected_socket, &socket_reading);
-        timer.tv_sec = 15;
-        timer.tv_usec = 0;
-        outcome = Select(FD_SETSIZE, &socket_reading, NULL, NULL, &timer);
-        if (outcome == 0) {
-            /* timeout expired */
-            return -2;
-        }
-        else if (outcome < 0) {
-            /* error happened*/
-            return -1;
+        if (must_wait) {
+            outcome = wait_socket(connected_socket, POLLIN, &deadline);
+            if (outcome == 0) {
+                /* timeout expired */
+                return -2;
+            }
+            else if (outcome < 0) {
+                /* error happened*/
+                return -1;
+            }
         }
 
-        new_received = recv(connected_socket, buf_cursor, to_read, 0);
+        new_received = recv(connected_socket, buf_cursor, to_read, MSG_DONTWAIT);
+        if (new_received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            must_wait = 1;
+            continue;
+        }
         if (new_received <= 0) {
             return -1;
         }
 
+        must_wait = ((size_t) new_received < to_read);
         to_read -= new_received;
         buf_cursor += new_received;
     }
@@ -142,40 +196,212 @@ int recv_n (int connected_socket, char* buffer, size_t n_elements) {
 
 
 /*
- * n_elements must be lower than maximum size of buffer
+ * n_elements must be lower than maximum size of buffer, the whole operation must complete within SOCKET_TIMEOUT seconds
  */
 int send_n(int connected_socket, const char* buffer, size_t n_elements) {
     char* buffer_cursor = (char* )buffer;
     ssize_t new_sent;
     size_t to_write = n_elements;
 
-    struct timeval timer;
-    fd_set socket_writing;
+    struct timespec deadline;
+    int outcome = 0;
+
+    int must_wait = 0;      /* the socket buffer is full, poll() it before the next send() */
+
+    set_deadline(&deadline);
+    while (to_write > 0) {
+        if (must_wait) {
+            outcome = wait_socket(connected_socket, POLLOUT, &deadline);
+            if (outcome <= 0) {
+                /* error happened or timeout expired */
+                return -1;
+            }
+        }
+
+        new_sent = send(connected_socket, buffer_cursor, to_write, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (new_sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            must_wait = 1;
+            continue;
+        }
+        if (new_sent <= 0) {
+            return -1;
+        }
+
+        must_wait = ((size_t) new_sent < to_write);
+        buffer_cursor += new_sent;
+        to_write -= new_sent;
+    }
+
+    return 1;
+}
+
+
+/*
+ * like send_n(), for a content of any length: the SOCKET_TIMEOUT seconds deadline restarts whenever bytes are sent,
+ * so that a slow but live client is not cut off however large the buffer is
+ */
+int send_stream(int connected_socket, const char* buffer, size_t n_elements) {
+    char* buffer_cursor = (char* )buffer;
+    ssize_t new_sent;
+    size_t to_write = n_elements;
+
+    struct timespec deadline;
     int outcome = 0;
 
+    int must_wait = 0;      /* the socket buffer is full, poll() it before the next send() */
+
+    set_deadline(&deadline);
     while (to_write > 0) {
-        FD_ZERO(&socket_writing);
-        FD_SET(connected_socket, &socket_writing);
-        timer.tv_sec = 15;
-        timer.tv_usec = 0;
-        outcome = Select(FD_SETSIZE, NULL, &socket_writing, NULL, &timer);
-        if (outcome <= 0) {
-            /* error happened or timeout expired */
+        if (must_wait) {
+            outcome = wait_socket(connected_socket, POLLOUT, &deadline);
+            if (outcome <= 0) {
+                /* error happened or nothing sent for SOCKET_TIMEOUT seconds */
+                return -1;
+            }
+        }
+
+        new_sent = send(connected_socket, buffer_cursor, to_write, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (new_sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            must_wait = 1;
+            continue;
+        }
+        if (new_sent <= 0) {
             return -1;
         }
 
-        new_sent = send(connected_socket, buffer_cursor, to_write, MSG_NOSIGNAL);
+        must_wait = ((size_t) new_sent < to_write);
+        buffer_cursor += new_sent;
+        to_write -= new_sent;
+        set_deadline(&deadline);
+    }
+
+    return 1;
+}
+
+
+/*
+ * sends the iov_count buffers of iov as a single one, with as few segments as possible: iov is consumed.
+ * the whole operation must complete within SOCKET_TIMEOUT seconds
+ */
+int sendv_n(int connected_socket, struct iovec* iov, int iov_count) {
+    struct msghdr message;
+    ssize_t new_sent;
+
+    struct timespec deadline;
+    int outcome = 0;
+
+    int must_wait = 0;      /* the socket buffer is full, poll() it before the next sendmsg() */
+
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = iov;
+    message.msg_iovlen = iov_count;
+
+    set_deadline(&deadline);
+    while (1) {
+        /* skip the buffers already sent */
+        while (message.msg_iovlen > 0 && message.msg_iov->iov_len == 0) {
+            message.msg_iov++;
+            message.msg_iovlen--;
+        }
+        if (message.msg_iovlen == 0) {
+            break;
+        }
+
+        if (must_wait) {
+            outcome = wait_socket(connected_socket, POLLOUT, &deadline);
+            if (outcome <= 0) {
+                /* error happened or timeout expired */
+                return -1;
+            }
+        }
+
+        new_sent = sendmsg(connected_socket, &message, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (new_sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            must_wait = 1;
+            continue;
+        }
         if (new_sent <= 0) {
-            if (errno == EINTR) {
-                new_sent = 0;
+            return -1;
+        }
+
+        size_t sent = (size_t) new_sent;
+        while (sent > 0 && sent >= message.msg_iov->iov_len) {
+            sent -= message.msg_iov->iov_len;
+            message.msg_iov->iov_len = 0;
+            message.msg_iov++;
+            message.msg_iovlen--;
+        }
+        if (sent > 0) {
+            message.msg_iov->iov_base = (char* ) message.msg_iov->iov_base + sent;
+            message.msg_iov->iov_len -= sent;
+        }
+        must_wait = (message.msg_iovlen > 0);
+    }
+
+    return 1;
+}
+
+
+/* while the socket is corked partial segments are held back, a response written in pieces leaves in full segments */
+void set_cork(int connected_socket, int on) {
+#ifdef TCP_CORK
+    setsockopt(connected_socket, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+#endif
+}
+
+
+/*
+ * zero-copy transfer of n_elements bytes of file_fd, starting from *offset, on the connected socket.
+ * *offset is advanced by the number of bytes sent. The socket must be nonblocking: the SOCKET_TIMEOUT
+ * seconds deadline restarts after every chunk that is sent.
+ * returns 1 on success, -1 on error, 0 if sendfile() is not supported for the file: the caller must send
+ * the remaining bytes (starting from *offset) with the copy loop.
+ */
+int sendfile_n(int connected_socket, int file_fd, off_t* offset, size_t n_elements) {
+#ifdef __linux__
+    ssize_t new_sent;
+    size_t to_write = n_elements;
+
+    struct timespec deadline;
+    int outcome = 0;
+
+    int must_wait = 0;      /* the socket buffer is full, poll() it before the next sendfile() */
+
+    set_deadline(&deadline);
+    while (to_write > 0) {
+        if (must_wait) {
+            outcome = wait_socket(connected_socket, POLLOUT, &deadline);
+            if (outcome <= 0) {
+                /* error happened or timeout expired */
+                return -1;
+            }
+        }
+
+        size_t chunk = to_write < SENDFILE_CHUNK ? to_write : SENDFILE_CHUNK;
+        new_sent = sendfile(connected_socket, file_fd, offset, chunk);
+        if (new_sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                must_wait = 1;
                 continue;
             }
+            if (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP) {
+                /* sendfile() not available for this file, fall back to the copy loop */
+                return 0;
+            }
+            return -1;
+        }
+        if (new_sent == 0) {
+            /* file is shorter than expected */
             return -1;
         }
 
-        buffer_cursor += new_sent;
+        must_wait = ((size_t) new_sent < chunk);
         to_write -= new_sent;
+        set_deadline(&deadline);
     }
 
     return 1;
-}
\ No newline at end of file
+#else
+    return 0;
+#endif
+}
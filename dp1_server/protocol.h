@@ -8,6 +8,14 @@
 #include <stdio.h>
 #include <signal.h>
 #include <unistd.h>
+#include <time.h>
+#include <sys/uio.h>
+
+/* seconds allowed to recv_n(), send_n(), to every chunk of sendfile_n() and between two sends of send_stream() */
+#define SOCKET_TIMEOUT 15
+
+/* maximum number of bytes handed to a single sendfile() call */
+#define SENDFILE_CHUNK (1 << 20)
 
 int Select(int max_fd, fd_set *read_set, fd_set *write_set, fd_set *except_set, struct timeval *timeout);
 int Socket (int family, int type, int protocol);
@@ -16,7 +24,13 @@ void Bind (int sockfd, const struct sockaddr *myaddr,  socklen_t myaddrlen);
 void Listen (int sockfd, int backlog);
 int Accept (int listen_sockfd, struct sockaddr *cliaddr, socklen_t *addrlenp);
 void Connect (int sockfd, const struct sockaddr *srvaddr, socklen_t addrlen);
+void set_deadline(struct timespec* deadline);
+int wait_socket(int connected_socket, short events, const struct timespec* deadline);
 int recv_n (int connected_socket, char* buffer, size_t n_elements);
 int send_n(int connected_socket, const char* buffer, size_t n_elements);
+int send_stream(int connected_socket, const char* buffer, size_t n_elements);
+int sendfile_n(int connected_socket, int file_fd, off_t* offset, size_t n_elements);
+int sendv_n(int connected_socket, struct iovec* iov, int iov_count);
+void set_cork(int connected_socket, int on);
 
 #endif
\ No newline at end of file
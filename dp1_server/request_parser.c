@@ -0,0 +1,159 @@
+/*
+ *  Parser of the requests of the file transfer protocol
+ *
+ *  Requests are parsed where they were received: the file name is returned as a pointer into the buffer, ended
+ *  by a '\0' written over its "\r\n", valid until more bytes are received. A single scan per byte finds the end of
+ *  the request and checks that the request has no control characters; it runs on 16 bytes at a time with SSE2.
+ *
+ */
+
+#include    <string.h>
+#include    "request_parser.h"
+#ifdef __SSE2__
+#include    <emmintrin.h>
+#endif
+
+
+void request_parser_init(struct request_parser* parser) {
+    parser->start = 0;
+    parser->len = 0;
+    parser->scanned = 0;
+}
+
+
+/* returns the position of the first byte of bytes[0, len) lower than ' ' or DEL, len if there is none */
+size_t find_control(const char* bytes, size_t len) {
+    size_t a = 0;
+#ifdef __SSE2__
+    const __m128i last_control = _mm_set1_epi8(0x1f);
+    const __m128i del = _mm_set1_epi8(0x7f);
+    for (; a + 16 <= len; a += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i*) &bytes[a]);
+        /* a byte is at most 0x1f if its unsigned minimum with 0x1f is the byte itself */
+        __m128i control = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(block, last_control), block), _mm_cmpeq_epi8(block, del));
+        int mask = _mm_movemask_epi8(control);
+        if (mask != 0) {
+            return a + (size_t) __builtin_ctz((unsigned) mask);
+        }
+    }
+#endif
+    for (; a < len; a++) {
+        unsigned char byte = (unsigned char) bytes[a];
+        if (byte < 0x20 || byte == 0x7f) {
+            return a;
+        }
+    }
+    return len;
+}
+
+
+/* parses the decimal number at *cursor followed by a space, moving *cursor after them. Returns -1 if there is none */
+static int parse_number(char** cursor, const char* end, uint64_t* value) {
+    char* digit = *cursor;
+    uint64_t number = 0;
+
+    while (digit < end && *digit >= '0' && *digit <= '9') {
+        if (number > (UINT64_MAX - 9) / 10) {
+            return -1;
+        }
+        number = number * 10 + (uint64_t) (*digit - '0');
+        ++digit;
+    }
+    if (digit == *cursor || digit == end || *digit != ' ') {
+        return -1;
+    }
+    *value = number;
+    *cursor = digit + 1;
+    return 0;
+}
+
+
+/*
+ * requests are "GET <file name>\r\n", "GETR <offset> <length> <file name>\r\n" for a byte range of the file, or
+ * "RESM <offset> <timestamp> <file name>\r\n" to resume an interrupted transfer. "HELO 2\r\n" asks for the v2 responses,
+ * and has an empty file name. "MGET <id> <file name>\r\n" asks for a response in frames.
+ * returns the length of the file name of the next request, -1 if the request is invalid, -2 if it is not complete yet.
+ */
+int request_parser_next(struct request_parser* parser, struct file_range* range, char** file_name) {
+    char* request = &parser->buffer[parser->start];
+    size_t available = parser->len - parser->start;
+
+    parser->scanned += find_control(&request[parser->scanned], available - parser->scanned);
+    if (parser->scanned == available || (parser->scanned + 1 == available && request[parser->scanned] == '\r')) {
+        /* a '\r' at the end may be followed by the '\n' of the next recv() */
+        return -2;
+    }
+    char* end = &request[parser->scanned];
+    if (end[0] != '\r' || end[1] != '\n') {
+        return -1;
+    }
+
+    /*  extrapolate the range and the file name  */
+    size_t request_len = parser->scanned;
+    char* name = NULL;
+    range->type = REQUEST_GET;
+    range->offset = 0;
+    range->length = UINT64_MAX;       /* clamped to the file size */
+    range->timestamp = 0;
+    if (request_len >= 4 && memcmp(request, "GET ", 4) == 0) {
+        name = &request[4];
+    }
+    else if (request_len == 6 && memcmp(request, "HELO 2", 6) == 0) {
+        range->type = REQUEST_HELLO;
+        name = end;
+    }
+    else if (request_len >= 5 && memcmp(request, "GETR ", 5) == 0) {
+        char* cursor = &request[5];
+        if (parse_number(&cursor, end, &range->offset) == 0 && parse_number(&cursor, end, &range->length) == 0) {
+            range->type = REQUEST_RANGE;
+            name = cursor;
+        }
+    }
+    else if (request_len >= 5 && memcmp(request, "MGET ", 5) == 0) {
+        char* cursor = &request[5];
+        uint64_t id;
+        if (parse_number(&cursor, end, &id) == 0 && id <= UINT32_MAX) {
+            range->type = REQUEST_MULTIPLEXED;
+            range->id = (uint32_t) id;
+            name = cursor;
+        }
+    }
+    else if (request_len >= 5 && memcmp(request, "RESM ", 5) == 0) {
+        char* cursor = &request[5];
+        if (parse_number(&cursor, end, &range->offset) == 0 && parse_number(&cursor, end, &range->timestamp) == 0) {
+            range->type = REQUEST_RESUME;
+            name = cursor;
+        }
+    }
+    if (name == NULL || end - name > MAX_LEN_FILE_NAME - 1) {
+        return -1;
+    }
+    *end = '\0';
+    *file_name = name;
+
+    /* the requests pipelined after this one stay in the buffer */
+    parser->start += request_len + 2;
+    parser->scanned = 0;
+    return (int) (end - name);
+}
+
+
+/*
+ * returns where the next bytes received go and in *available how many fit there, 0 if the request being received
+ * fills the whole buffer. The views returned by request_parser_next() are not valid anymore.
+ */
+char* request_parser_space(struct request_parser* parser, size_t* available) {
+    if (parser->start > 0) {
+        /* move the beginning of the request being received to the beginning of the buffer */
+        memmove(parser->buffer, &parser->buffer[parser->start], parser->len - parser->start);
+        parser->len -= parser->start;
+        parser->start = 0;
+    }
+    *available = REQUEST_BUFFER_LEN - parser->len;
+    return &parser->buffer[parser->len];
+}
+
+
+void request_parser_received(struct request_parser* parser, size_t received) {
+    parser->len += received;
+}
@@ -0,0 +1,172 @@
+/*
+ *  Pipelined copy loop
+ *
+ *  With the copy loop (-c, or sendfile() not supported) a single buffer makes the disk and the network take turns:
+ *  the file is not read while send() waits for room in the socket buffer, nothing is sent while pread() waits for
+ *  the disk. Here a reader thread fills a ring of buffers from the file while the thread serving the connection
+ *  sends the filled ones, so the two overlap as long as the ring is neither full nor empty.
+ *  The thread and the buffers are created by the first transfer of the process, after fork(), and serve one range
+ *  at a time: send_pipeline_send() returns only once the reader has stopped, the file descriptor can be closed then.
+ *
+ */
+
+#define     _GNU_SOURCE
+#include    <stdlib.h>
+#include    <string.h>
+#include    <stdio.h>
+#include    <unistd.h>
+#include    <pthread.h>
+#include    "send_pipeline.h"
+#include    "protocol.h"
+
+static int n_buffers = SEND_PIPELINE_BUFFERS;       /* 0 disables the pipeline */
+static size_t buffer_len = SEND_PIPELINE_BUFFER_LEN;
+static int started = 0;                             /* 1 once the reader runs, -1 if it could not be started */
+static char* buffers = NULL;                        /* n_buffers of buffer_len bytes */
+static size_t* filled_len = NULL;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t new_range = PTHREAD_COND_INITIALIZER;     /* to the reader: a range to read */
+static pthread_cond_t buffer_free = PTHREAD_COND_INITIALIZER;   /* to the reader: a buffer has been sent */
+static pthread_cond_t buffer_filled = PTHREAD_COND_INITIALIZER; /* to the sender: a buffer to send, or reader done */
+
+/* the range being sent, protected by lock */
+static int active = 0;
+static int file_fd = -1;
+static uint64_t offset;
+static uint64_t to_read;
+static int head;                                    /* next buffer filled by the reader */
+static int tail;                                    /* next buffer sent */
+static int n_filled;
+static int reader_done;                             /* the reader has stopped on this range */
+static int read_error;
+static int cancelled;                               /* the sender gave up, the reader stops */
+
+
+/* sets the ring before the first transfer: n buffers of len bytes, n == 0 sends with a single buffer */
+void send_pipeline_init(int n, size_t len) {
+    n_buffers = n;
+    buffer_len = len;
+}
+
+
+static void* reader(void* unused) {
+    (void) unused;
+    pthread_mutex_lock(&lock);
+    for (;;) {
+        while (!active || reader_done) {
+            pthread_cond_wait(&new_range, &lock);
+        }
+
+        while (to_read > 0 && !cancelled) {
+            while (n_filled == n_buffers && !cancelled) {
+                pthread_cond_wait(&buffer_free, &lock);
+            }
+            if (cancelled) {
+                break;
+            }
+            int buffer = head;
+            size_t len = to_read < buffer_len ? (size_t) to_read : buffer_len;
+            off_t read_offset = (off_t) offset;
+            pthread_mutex_unlock(&lock);
+
+            /* pread(): the file descriptor is shared by all the responses with the same file */
+            ssize_t eff_read = pread(file_fd, &buffers[(size_t) buffer * buffer_len], len, read_offset);
+
+            pthread_mutex_lock(&lock);
+            if (eff_read != (ssize_t) len) {
+                /* error while reading the file on the file system, or the file has shrunk */
+                read_error = 1;
+                break;
+            }
+            filled_len[buffer] = len;
+            head = (head + 1) % n_buffers;
+            n_filled++;
+            offset += len;
+            to_read -= len;
+            pthread_cond_signal(&buffer_filled);
+        }
+        reader_done = 1;
+        pthread_cond_signal(&buffer_filled);
+    }
+    return NULL;
+}
+
+
+/* starts the reader of this process. returns -1 if it cannot be started */
+static int start(void) {
+    if (started != 0) {
+        return started > 0 ? 0 : -1;
+    }
+    started = -1;
+    buffers = malloc((size_t) n_buffers * buffer_len);
+    filled_len = malloc((size_t) n_buffers * sizeof(*filled_len));
+    pthread_t thread;
+    if (buffers == NULL || filled_len == NULL || pthread_create(&thread, NULL, reader, NULL) != 0) {
+        printf("cannot start the reader thread - files sent with a single buffer\n");
+        free(buffers);
+        free(filled_len);
+        return -1;
+    }
+    pthread_detach(thread);
+    started = 1;
+    return 0;
+}
+
+
+/*
+ * sends length bytes of file_fd from offset, read by the reader thread. returns 1 on success, -1 on error,
+ * 0 if the pipeline is disabled or cannot be started and nothing has been sent.
+ */
+int send_pipeline_send(int connected_socket, int fd, uint64_t from, uint64_t length) {
+    if (n_buffers <= 0 || start() < 0) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&lock);
+    file_fd = fd;
+    offset = from;
+    to_read = length;
+    head = tail = n_filled = 0;
+    reader_done = read_error = cancelled = 0;
+    active = 1;
+    pthread_cond_signal(&new_range);
+
+    int outcome = 1;
+    for (;;) {
+        while (n_filled == 0 && !reader_done) {
+            pthread_cond_wait(&buffer_filled, &lock);
+        }
+        if (n_filled == 0) {
+            break;
+        }
+        int buffer = tail;
+        pthread_mutex_unlock(&lock);
+
+        /* the deadline restarts with every send(): a buffer of any length can go to a slow client */
+        int sent = send_stream(connected_socket, &buffers[(size_t) buffer * buffer_len], filled_len[buffer]);
+
+        pthread_mutex_lock(&lock);
+        if (sent <= 0) {
+            /* error while sending the file */
+            cancelled = 1;
+            pthread_cond_signal(&buffer_free);
+            outcome = -1;
+            break;
+        }
+        tail = (tail + 1) % n_buffers;
+        n_filled--;
+        pthread_cond_signal(&buffer_free);
+    }
+
+    /* the buffers and file_fd are the reader's until it stops */
+    while (!reader_done) {
+        pthread_cond_wait(&buffer_filled, &lock);
+    }
+    if (read_error) {
+        outcome = -1;
+    }
+    active = 0;
+    pthread_mutex_unlock(&lock);
+    return outcome;
+}
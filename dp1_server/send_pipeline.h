@@ -0,0 +1,19 @@
+#ifndef _SEND_PIPELINE_H
+#define _SEND_PIPELINE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* ring of buffers filled from the file by a reader thread while the connection drains them, for the copy loop (-c) */
+#define SEND_PIPELINE_BUFFERS 4                     /* default number of buffers, -r on the command line */
+/*
+ * default bytes of a buffer, -l on the command line. A buffer is sent with send_stream(), whose SOCKET_TIMEOUT
+ * deadline restarts whenever bytes are sent: a larger buffer costs memory, not a higher minimum speed of the client,
+ * and a client that stalls is still cut off after SOCKET_TIMEOUT seconds
+ */
+#define SEND_PIPELINE_BUFFER_LEN (1024 * 1024)
+
+void send_pipeline_init(int n_buffers, size_t buffer_len);
+int send_pipeline_send(int connected_socket, int file_fd, uint64_t offset, uint64_t length);
+
+#endif
@@ -0,0 +1,556 @@
+/*
+ *  IO_URING TCP SERVER
+ *  Distributed Programming I
+ *  File transfer TCP server - single thread, all socket and file I/O submitted through io_uring
+ *
+ * 	File name: main.c
+ *
+ *  Same GET / +OK / -ERR protocol as the other servers. Connections are accepted with one multishot
+ *  accept straight into the fixed file table, every connection owns a slice of one registered buffer
+ *  and file data is moved with linked READ_FIXED -> WRITE_FIXED operations, so that the header, the
+ *  content and the trailer of a file reach the socket without any copy in user space.
+ *
+ */
+
+#define     _GNU_SOURCE
+#include    <stdlib.h>
+#include    <string.h>
+#include    <inttypes.h>
+#include    <sys/stat.h>
+#include    <sys/mman.h>
+#include    <sys/syscall.h>
+#include    <sys/uio.h>
+#include    <errno.h>
+#include    <fcntl.h>
+#include    <unistd.h>
+#include    <stdio.h>
+#include    <signal.h>
+#include    <sys/socket.h>
+#include    <netinet/in.h>
+#include    <arpa/inet.h>
+#include    <netdb.h>
+#include    <limits.h>
+#include    <linux/io_uring.h>
+#include    "protocol.h"
+
+
+#define MAX_LEN_FILE_NAME 200
+#define MAX_LEN_REQUEST (MAX_LEN_FILE_NAME + 6)     /* "GET " + file name + "\r\n" */
+#define URING_ENTRIES 4096
+#define MAX_CONNECTIONS 1024                        /* size of the fixed file table */
+#define URINGBUFLEN (32 * 1024)                     /* slice of the registered buffer owned by each connection */
+#define CONNECTION_TIMEOUT 15                       /* seconds, same as the select() timer of the other servers */
+char *program_name;
+
+
+/* kind of operation, stored in the low byte of user_data, the index of the connection is in the upper bytes */
+enum operation { OP_IGNORE, OP_ACCEPT, OP_RECV, OP_READ, OP_WRITE };
+
+enum connection_state {
+    READING_REQUEST,        /* waiting for a complete "GET <file name>\r\n" line */
+    SENDING_FILE,           /* header, content and timestamp of the file */
+    SENDING_ERROR           /* "-ERR\r\n", the connection is closed afterwards */
+};
+
+struct connection {
+    int inflight;                               /* submitted operations not completed yet */
+    int closing;                                /* closed as soon as inflight drops to zero */
+    enum connection_state state;
+
+    char request[MAX_LEN_REQUEST];              /* received bytes not parsed yet (carry-over of pipelined requests) */
+    size_t request_len;
+
+    char* buffer;                               /* slice of the registered buffer */
+    size_t header_len;                          /* bytes of "+OK\r\n<size>" at the start of buffer not sent yet */
+    size_t chunk_len;                           /* bytes of the file read in buffer after the header */
+    size_t out_len, out_sent;                   /* bytes of buffer to send with the current write */
+    int last_chunk;                             /* the timestamp follows the chunk in buffer */
+    ssize_t read_result;                        /* outcome of the linked read, for short reads */
+
+    int file_fd;
+    uint32_t file_size, file_offset, timestamp;
+};
+
+
+struct uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask;
+    struct io_uring_sqe* sqes;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe* cqes;
+    unsigned entries;
+    unsigned to_submit;
+};
+
+struct uring ring;
+struct connection connections[MAX_CONNECTIONS];
+struct __kernel_timespec connection_timeout = { CONNECTION_TIMEOUT, 0 };
+int passive_socket;
+int accept_stopped = 0;                     /* the fixed file table was full, accept again once a slot is closed */
+
+
+int uring_setup(struct uring* r, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    r->fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+    if (r->fd < 0) {
+        return -1;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        /* kernels older than 5.4 are not supported */
+        return -1;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    size_t ring_size = sq_size > cq_size ? sq_size : cq_size;
+    char* rings = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (rings == MAP_FAILED) {
+        return -1;
+    }
+    r->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        return -1;
+    }
+
+    r->sq_head = (unsigned*) (rings + params.sq_off.head);
+    r->sq_tail = (unsigned*) (rings + params.sq_off.tail);
+    r->sq_mask = (unsigned*) (rings + params.sq_off.ring_mask);
+    r->cq_head = (unsigned*) (rings + params.cq_off.head);
+    r->cq_tail = (unsigned*) (rings + params.cq_off.tail);
+    r->cq_mask = (unsigned*) (rings + params.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*) (rings + params.cq_off.cqes);
+    r->entries = params.sq_entries;
+    r->to_submit = 0;
+
+    /* submission entries are always used in order */
+    unsigned* sq_array = (unsigned*) (rings + params.sq_off.array);
+    for (unsigned i = 0; i < params.sq_entries; ++i) {
+        sq_array[i] = i;
+    }
+    return 1;
+}
+
+
+/* returns the number of completions available, -1 on error */
+int uring_submit(struct uring* r, unsigned wait_for) {
+    int n;
+    again:
+    n = (int) syscall(__NR_io_uring_enter, r->fd, r->to_submit, wait_for, wait_for > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (n < 0) {
+        if (errno == EINTR)
+            goto again;
+        return -1;
+    }
+    r->to_submit -= (unsigned) n < r->to_submit ? (unsigned) n : r->to_submit;
+    return n;
+}
+
+
+struct io_uring_sqe* uring_get_sqe(struct uring* r) {
+    unsigned tail = *r->sq_tail;
+    while (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->entries) {
+        /* submission queue is full */
+        if (uring_submit(r, 0) < 0) {
+            printf("error - io_uring_enter() failed\n");
+            exit(-1);
+        }
+    }
+    struct io_uring_sqe* sqe = &r->sqes[tail & *r->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->to_submit++;
+    return sqe;
+}
+
+
+uint64_t user_data(struct connection* c, enum operation op) {
+    return ((uint64_t) (c - connections) << 8) | op;
+}
+
+
+/* limit the previous (linked) operation to CONNECTION_TIMEOUT seconds */
+void post_link_timeout(void) {
+    struct io_uring_sqe* sqe = uring_get_sqe(&ring);
+    sqe->opcode = IORING_OP_LINK_TIMEOUT;
+    sqe->addr = (uint64_t) (uintptr_t) &connection_timeout;
+    sqe->len = 1;
+    sqe->user_data = OP_IGNORE;
+}
+
+
+void post_accept(void) {
+    struct io_uring_sqe* sqe = uring_get_sqe(&ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = passive_socket;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->file_index = IORING_FILE_INDEX_ALLOC;
+    sqe->user_data = OP_ACCEPT;
+}
+
+
+void post_recv(struct connection* c) {
+    struct io_uring_sqe* sqe = uring_get_sqe(&ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+    sqe->fd = (int) (c - connections);
+    sqe->addr = (uint64_t) (uintptr_t) &c->request[c->request_len];
+    sqe->len = (unsigned) (MAX_LEN_REQUEST - c->request_len);
+    sqe->user_data = user_data(c, OP_RECV);
+    c->inflight++;
+    post_link_timeout();
+}
+
+
+/* send buffer[out_sent, out_len), after the read of the file posted just before (if any) */
+void post_write(struct connection* c) {
+    struct io_uring_sqe* sqe = uring_get_sqe(&ring);
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+    sqe->fd = (int) (c - connections);
+    sqe->addr = (uint64_t) (uintptr_t) &c->buffer[c->out_sent];
+    sqe->len = (unsigned) (c->out_len - c->out_sent);
+    sqe->off = (uint64_t) -1;
+    sqe->buf_index = 0;
+    sqe->user_data = user_data(c, OP_WRITE);
+    c->inflight++;
+    post_link_timeout();
+}
+
+
+/* read the next chunk of the file after the header (if any) and send them together */
+void post_chunk(struct connection* c) {
+    size_t room = URINGBUFLEN - c->header_len - 4;
+    uint32_t remaining = c->file_size - c->file_offset;
+
+    c->chunk_len = remaining < room ? remaining : room;
+    c->out_len = c->header_len + c->chunk_len;
+    c->out_sent = 0;
+    c->last_chunk = (c->chunk_len == remaining);
+    if (c->last_chunk) {
+        /* timestamp of last file modification, in the same byte order used by the other servers */
+        uint32_t timestamp_file_net = htonl(htonl(c->timestamp));
+        memcpy(&c->buffer[c->out_len], &timestamp_file_net, 4);
+        c->out_len += 4;
+    }
+
+    if (c->chunk_len > 0) {
+        struct io_uring_sqe* sqe = uring_get_sqe(&ring);
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->fd = c->file_fd;
+        sqe->addr = (uint64_t) (uintptr_t) &c->buffer[c->header_len];
+        sqe->len = (unsigned) c->chunk_len;
+        sqe->off = c->file_offset;
+        sqe->buf_index = 0;
+        sqe->user_data = user_data(c, OP_READ);
+        c->inflight++;
+    }
+    /* also for an empty chunk: a cancelled write is then a timeout, not a short read */
+    c->read_result = (ssize_t) c->chunk_len;
+    post_write(c);
+}
+
+
+void close_connection(struct connection* c) {
+    if (c->file_fd >= 0) {
+        close(c->file_fd);
+        c->file_fd = -1;
+    }
+    printf("End of service for the client on socket %d - closing the connection.\n", (int) (c - connections));
+
+    struct io_uring_sqe* sqe = uring_get_sqe(&ring);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = (unsigned) (c - connections) + 1;
+    sqe->user_data = OP_IGNORE;
+    if (accept_stopped) {
+        /* linked: the accept starts once the slot is free */
+        sqe->flags = IOSQE_IO_LINK;
+        accept_stopped = 0;
+        post_accept();
+    }
+}
+
+
+/*
+ * extract the first request line from the carry-over buffer.
+ * returns 1 and fills file_name if a complete request was parsed, 0 if more bytes are needed, -1 for an invalid request
+ */
+int parse_request(struct connection* c, char* file_name) {
+    char* end = NULL;
+    for (size_t i = 1; i < c->request_len; ++i) {
+        if (c->request[i - 1] == '\r' && c->request[i] == '\n') {
+            end = &c->request[i - 1];
+            break;
+        }
+    }
+    if (end == NULL) {
+        if (c->request_len == MAX_LEN_REQUEST) {
+            /* request message is longer than the longest valid request */
+            return -1;
+        }
+        return 0;
+    }
+
+    if (end < &c->request[4] || c->request[0] != 'G' || c->request[1] != 'E' || c->request[2] != 'T' || c->request[3] != ' ') {
+        return -1;
+    }
+    size_t name_len = (size_t) (end - &c->request[4]);
+    memcpy(file_name, &c->request[4], name_len);
+    file_name[name_len] = '\0';
+
+    /* keep the bytes of the following requests */
+    size_t consumed = (size_t) (end - c->request) + 2;
+    memmove(c->request, &c->request[consumed], c->request_len - consumed);
+    c->request_len -= consumed;
+    return 1;
+}
+
+
+/* serve the next request of the connection, or wait for it. returns -1 if the connection must be closed */
+int next_request(struct connection* c) {
+    char file_name[MAX_LEN_FILE_NAME + 1];
+    struct stat my_stat;
+    int socket_index = (int) (c - connections);
+
+    int outcome = parse_request(c, file_name);
+    if (outcome < 0) {
+        printf("Waiting for a request from client but received an invalid request.\n");
+        return -1;
+    }
+    if (outcome == 0) {
+        post_recv(c);
+        return 1;
+    }
+
+    printf("requested file on socket %d: %s\n", socket_index, file_name);
+    c->file_fd = open(file_name, O_RDONLY);
+    if (c->file_fd < 0) {
+        printf("file requested on socket %d does not exist on the server\n", socket_index);
+        memcpy(c->buffer, "-ERR\r\n", 6);
+        c->out_len = 6;
+        c->out_sent = 0;
+        c->state = SENDING_ERROR;
+        post_write(c);
+        return 1;
+    }
+    if (fstat(c->file_fd, &my_stat) == -1) {
+        printf("error while getting timestamp and size for file %s on socket %d\n", file_name, socket_index);
+        return -1;
+    }
+    c->file_size = (uint32_t) my_stat.st_size;
+    c->timestamp = (uint32_t) my_stat.st_mtime;
+    c->file_offset = 0;
+
+    /* heading of file transfer, sent together with the first chunk of the file */
+    uint32_t n_characters_net = htonl(c->file_size);
+    memcpy(c->buffer, "+OK\r\n", 5);
+    memcpy(&c->buffer[5], &n_characters_net, 4);
+    c->header_len = 9;
+    c->state = SENDING_FILE;
+    post_chunk(c);
+    return 1;
+}
+
+
+/* returns -1 if the connection must be closed */
+int handle_completion(struct connection* c, enum operation op, int res) {
+    int socket_index = (int) (c - connections);
+
+    switch (op) {
+        case OP_RECV:
+            if (res == -ECANCELED) {
+                printf("timeout expired for the client on socket %d.\n", socket_index);
+                return -1;
+            }
+            if (res <= 0) {
+                /* error or end of file requests from Client */
+                return -1;
+            }
+            c->request_len += res;
+            return next_request(c);
+
+        case OP_READ:
+            /* a short read breaks the link and the write is cancelled */
+            c->read_result = res;
+            return 1;
+
+        case OP_WRITE:
+            if (res == -ECANCELED && c->read_result != (ssize_t) c->chunk_len) {
+                /* error while reading the file on the file system, or file is shorter than expected */
+                printf("error occurred while sending the file on socket %d to client\n", socket_index);
+                return -1;
+            }
+            if (res <= 0) {
+                if (res == -ECANCELED) {
+                    printf("timeout expired for the client on socket %d.\n", socket_index);
+                }
+                return -1;
+            }
+
+            c->out_sent += res;
+            if (c->out_sent < c->out_len) {
+                post_write(c);
+                return 1;
+            }
+            if (c->state == SENDING_ERROR) {
+                /* end of service for the Client */
+                return -1;
+            }
+
+            c->file_offset += c->chunk_len;
+            c->header_len = 0;
+            if (!c->last_chunk) {
+                post_chunk(c);
+                return 1;
+            }
+            close(c->file_fd);
+            c->file_fd = -1;
+            printf("file transfer on socket %d was successful.\n", socket_index);
+            c->state = READING_REQUEST;
+            return next_request(c);
+
+        default:
+            return 1;
+    }
+}
+
+
+void new_connection(int index) {
+    struct connection* c = &connections[index];
+    char* buffer = c->buffer;
+
+    memset(c, 0, sizeof(*c));
+    c->buffer = buffer;
+    c->file_fd = -1;
+    c->state = READING_REQUEST;
+    printf("Accepted new connection on socket %d.\n", index);
+    post_recv(c);
+}
+
+
+int main(int argc, char *argv[])
+{
+    uint16_t 	lport_n, lport_h;	/* port used by server (net/host ord.) */
+    struct sockaddr_in 	saddr;	/* server address */
+
+    program_name = argv[0];
+
+    if (argc != 2) {
+        printf("Usage: %s <port number>\n", program_name);
+        exit(1);
+    }
+
+    unsigned long tmp_port = strtoul(argv[1], NULL, 0);
+    if ((tmp_port == ULONG_MAX) || (tmp_port < 1024) || (tmp_port > 65535)) {
+        printf("Enter a valid port number - port numbers must be between 1024 and 65535\n");
+        exit(1);
+    }
+    lport_h = (uint16_t) tmp_port;
+    lport_n = htons(lport_h);
+
+    /* a write on a socket closed by the client must not terminate the server */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* create the socket */
+    passive_socket = Socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+    /* bind the socket to any local IP address */
+    bzero(&saddr, sizeof(saddr));
+    saddr.sin_family      = AF_INET;
+    saddr.sin_port        = lport_n;
+    saddr.sin_addr.s_addr = INADDR_ANY;
+    Bind(passive_socket, (struct sockaddr *) &saddr, sizeof(saddr));
+
+    /* listen */
+    int		bk_log = SOMAXCONN;                                     /* listen backlog */
+    Listen(passive_socket, bk_log);
+
+    if (uring_setup(&ring, URING_ENTRIES) < 0) {
+        printf("error - cannot set up io_uring\n");
+        exit(-1);
+    }
+
+    /* sparse fixed file table for the connected sockets */
+    int fixed_files[MAX_CONNECTIONS];
+    for (int i = 0; i < MAX_CONNECTIONS; ++i) {
+        fixed_files[i] = -1;
+    }
+    if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_FILES, fixed_files, MAX_CONNECTIONS) < 0) {
+        printf("error - cannot register the fixed file table\n");
+        exit(-1);
+    }
+
+    /* one registered buffer, sliced among the connections */
+    struct iovec registered;
+    registered.iov_len = (size_t) MAX_CONNECTIONS * URINGBUFLEN;
+    registered.iov_base = mmap(NULL, registered.iov_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (registered.iov_base == MAP_FAILED) {
+        printf("error - cannot allocate the buffers\n");
+        exit(-1);
+    }
+    if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS, &registered, 1) < 0) {
+        printf("error - cannot register the buffers\n");
+        exit(-1);
+    }
+    for (int i = 0; i < MAX_CONNECTIONS; ++i) {
+        connections[i].buffer = (char*) registered.iov_base + (size_t) i * URINGBUFLEN;
+    }
+
+    /* main server loop */
+    printf("Waiting for first Client connection...\n");
+    post_accept();
+
+    while (1)
+    {
+        if (uring_submit(&ring, 1) < 0) {
+            printf("error - io_uring_enter() failed\n");
+            exit(-1);
+        }
+
+        unsigned head = *ring.cq_head;
+        while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe* cqe = &ring.cqes[head & *ring.cq_mask];
+            enum operation op = (enum operation) (cqe->user_data & 0xff);
+            int index = (int) (cqe->user_data >> 8);
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            __atomic_store_n(ring.cq_head, ++head, __ATOMIC_RELEASE);
+
+            if (op == OP_ACCEPT) {
+                if (res >= 0) {
+                    new_connection(res);
+                }
+                else if (res == -ENFILE || res == -EMFILE) {
+                    /* no free slot in the fixed file table: the clients wait in the backlog until one is closed */
+                    printf("error - accept() failed, %d connections open\n", MAX_CONNECTIONS);
+                    if (!(flags & IORING_CQE_F_MORE)) {
+                        accept_stopped = 1;
+                    }
+                    continue;
+                }
+                else {
+                    printf("error - accept() failed\n");
+                }
+                if (!(flags & IORING_CQE_F_MORE)) {
+                    /* multishot accept terminated, arm it again */
+                    post_accept();
+                }
+                continue;
+            }
+            if (op == OP_IGNORE) {
+                continue;
+            }
+
+            struct connection* c = &connections[index];
+            c->inflight--;
+            if (!c->closing && handle_completion(c, op, res) < 0) {
+                c->closing = 1;
+            }
+            if (c->closing && c->inflight == 0) {
+                close_connection(c);
+            }
+        }
+    }
+}
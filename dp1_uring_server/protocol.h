@@ -0,0 +1,32 @@
+
+#ifndef _PROTOCOL_H
+#define _PROTOCOL_H
+
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+
+/* seconds allowed to recv_n(), send_n() and to every chunk of sendfile_n() */
+#define SOCKET_TIMEOUT 15
+
+/* maximum number of bytes handed to a single sendfile() call */
+#define SENDFILE_CHUNK (1 << 20)
+
+int Select(int max_fd, fd_set *read_set, fd_set *write_set, fd_set *except_set, struct timeval *timeout);
+int Socket (int family, int type, int protocol);
+void Close (int fd);
+void Bind (int sockfd, const struct sockaddr *myaddr,  socklen_t myaddrlen);
+void Listen (int sockfd, int backlog);
+int Accept (int listen_sockfd, struct sockaddr *cliaddr, socklen_t *addrlenp);
+void Connect (int sockfd, const struct sockaddr *srvaddr, socklen_t addrlen);
+void set_deadline(struct timespec* deadline);
+int wait_socket(int connected_socket, short events, const struct timespec* deadline);
+int recv_n (int connected_socket, char* buffer, size_t n_elements);
+int send_n(int connected_socket, const char* buffer, size_t n_elements);
+int sendfile_n(int connected_socket, int file_fd, off_t* offset, size_t n_elements);
+
+#endif
\ No newline at end of file